@@ -0,0 +1,336 @@
+//
+// Memory-mapped columnar snapshots of DatabaseRecord tables
+//
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ColumnSnapshot.h"
+
+using namespace std;
+
+static const char MAGIC[8] = { 'D','B','R','C','O','L','S','1' };
+static const size_t ALIGN = 64;
+
+/**
+ * \returns pos rounded up to the next multiple of ALIGN
+ */
+static uint64_t align( uint64_t pos ) {
+    return (pos+ALIGN-1)/ALIGN*ALIGN;
+}
+
+/**
+ * write zeros up to the next multiple of ALIGN
+ */
+static void pad( ofstream &out, uint64_t pos ) {
+    static const char zeros[ALIGN] = {0};
+    out.write( zeros, align(pos)-pos );
+}
+
+
+/**
+ * Write all mapped fields of the rows of rec's table that match
+ * where_clause to a columnar snapshot file, which can then be opened
+ * with ColumnSnapshot. The rows are read with
+ * DatabaseRecord::readColumns(), so the selected part of the table
+ * must fit in memory once. int16 and bool fields are written as int
+ * columns, and array fields are left out.
+ *
+ * \returns the number of rows written
+ */
+size_t
+ColumnSnapshot::write( DatabaseRecord &rec, const std::string &filename,
+		       std::string where_clause ) {
+
+    vector<string> names;
+    vector<Column> layout;
+    vector< vector<uint64_t> > offsets;
+    std::map< std::string, DatabaseField >::iterator it;
+    ostringstream header;
+    uint64_t pos=0;
+
+    for (it=rec._fieldmap->begin(); it != rec._fieldmap->end(); it++) {
+	if (it->second.type == FIELD_BLOB) continue;
+	names.push_back( it->first );
+    }
+    if (names.empty())
+	throw runtime_error("ColumnSnapshot::write(): no fields in '"
+			    +rec.getTableName()+"'");
+
+    DatabaseColumns cols = rec.readColumns( names, where_clause );
+    size_t n = cols.size();
+
+    // column positions are relative to the start of the data, which
+    // follows the header
+
+    header << "rows " << n << "\n";
+    header << "schema " << rec.getSchema() << "\n";
+
+    for (size_t i=0; i<names.size(); i++) {
+	Column c;
+	c.type = (*rec._fieldmap)[names[i]].type;
+	if (c.type == FIELD_STRING_VIEW) c.type = FIELD_STRING;
+	if (c.type == FIELD_INT16 || c.type == FIELD_BOOL) c.type = FIELD_INT;
+	c.offset = pos;
+	c.heap = 0;
+	offsets.push_back( vector<uint64_t>() );
+
+	switch (c.type) {
+	case FIELD_INT:
+	    pos = align( pos + n*sizeof(int) );
+	    header << "column " << names[i] << " int " << c.offset << "\n";
+	    break;
+	case FIELD_DOUBLE:
+	    pos = align( pos + n*sizeof(double) );
+	    header << "column " << names[i] << " double " << c.offset << "\n";
+	    break;
+	case FIELD_INT64:
+	    pos = align( pos + n*sizeof(int64_t) );
+	    header << "column " << names[i] << " int64 " << c.offset << "\n";
+	    break;
+	case FIELD_FLOAT:
+	    pos = align( pos + n*sizeof(float) );
+	    header << "column " << names[i] << " float " << c.offset << "\n";
+	    break;
+	case FIELD_STRING:
+	case FIELD_STRING_VIEW: {
+	    const vector<string> &str = cols.get<std::string>( names[i] );
+	    vector<uint64_t> &off = offsets.back();
+	    off.push_back(0);
+	    for (size_t j=0; j<n; j++) off.push_back( off.back()+str[j].length() );
+	    pos = align( pos + off.size()*sizeof(uint64_t) );
+	    c.heap = pos;
+	    pos = align( pos + off.back() );
+	    header << "column " << names[i] << " string " << c.offset 
+		   << " " << c.heap << "\n";
+	    break;
+	}
+	case FIELD_INT16:	// written as FIELD_INT
+	case FIELD_BOOL:
+	case FIELD_BLOB:	// left out above
+	    break;
+	}
+	layout.push_back(c);
+    }
+
+    string text = header.str();
+    uint64_t textlen = text.length();
+
+    ofstream out( filename.c_str(), ios::binary | ios::trunc );
+    if (!out) 
+	throw runtime_error("ColumnSnapshot::write(): can't open '"
+			    +filename+"'");
+
+    out.write( MAGIC, sizeof(MAGIC) );
+    out.write( (const char*) &textlen, sizeof(textlen) );
+    out.write( text.data(), textlen );
+    pad( out, sizeof(MAGIC)+sizeof(textlen)+textlen );
+
+    for (size_t i=0; i<names.size(); i++) {
+	switch (layout[i].type) {
+	case FIELD_INT: {
+	    const vector<int> &v = cols.get<int>( names[i] );
+	    out.write( (const char*) v.data(), n*sizeof(int) );
+	    pad( out, n*sizeof(int) );
+	    break;
+	}
+	case FIELD_DOUBLE: {
+	    const vector<double> &v = cols.get<double>( names[i] );
+	    out.write( (const char*) v.data(), n*sizeof(double) );
+	    pad( out, n*sizeof(double) );
+	    break;
+	}
+	case FIELD_INT64: {
+	    const vector<int64_t> &v = cols.get<int64_t>( names[i] );
+	    out.write( (const char*) v.data(), n*sizeof(int64_t) );
+	    pad( out, n*sizeof(int64_t) );
+	    break;
+	}
+	case FIELD_FLOAT: {
+	    const vector<float> &v = cols.get<float>( names[i] );
+	    out.write( (const char*) v.data(), n*sizeof(float) );
+	    pad( out, n*sizeof(float) );
+	    break;
+	}
+	case FIELD_STRING:
+	case FIELD_STRING_VIEW: {
+	    const vector<string> &str = cols.get<std::string>( names[i] );
+	    const vector<uint64_t> &off = offsets[i];
+	    out.write( (const char*) off.data(), off.size()*sizeof(uint64_t) );
+	    pad( out, off.size()*sizeof(uint64_t) );
+	    for (size_t j=0; j<n; j++) out.write( str[j].data(), str[j].length() );
+	    pad( out, off.back() );
+	    break;
+	}
+	case FIELD_INT16:
+	case FIELD_BOOL:
+	case FIELD_BLOB:
+	    break;
+	}
+    }
+
+    out.close();
+    if (!out)
+	throw runtime_error("ColumnSnapshot::write(): error writing '"
+			    +filename+"'");
+
+    return n;
+
+}
+
+
+/**
+ * Map a snapshot file written by write() into memory
+ */
+ColumnSnapshot::ColumnSnapshot( const std::string &filename )
+    : _filename(filename), _map(NULL), _mapsize(0), _nrows(0)
+{
+
+    struct stat st;
+    uint64_t textlen, data;
+    int fd;
+
+    fd = open( filename.c_str(), O_RDONLY );
+    if (fd < 0) 
+	throw runtime_error("ColumnSnapshot: can't open '"+filename+"'");
+    if (fstat( fd, &st ) != 0 || st.st_size < (off_t)(sizeof(MAGIC)+8)) {
+	close(fd);
+	throw runtime_error("ColumnSnapshot: '"+filename
+			    +"' is not a snapshot file");
+    }
+
+    _mapsize = st.st_size;
+    void *map = mmap( NULL, _mapsize, PROT_READ, MAP_SHARED, fd, 0 );
+    close(fd);
+    if (map == MAP_FAILED) 
+	throw runtime_error("ColumnSnapshot: can't map '"+filename+"'");
+    _map = (const char*) map;
+
+    try {
+
+	memcpy( &textlen, _map+sizeof(MAGIC), sizeof(textlen) );
+	if (memcmp( _map, MAGIC, sizeof(MAGIC) ) != 0 
+	    || textlen > _mapsize-sizeof(MAGIC)-sizeof(textlen))
+	    throw runtime_error("ColumnSnapshot: '"+filename
+				+"' is not a snapshot file");
+
+	data = align( sizeof(MAGIC)+sizeof(textlen)+textlen );
+	istringstream header( string( _map+sizeof(MAGIC)+sizeof(textlen), 
+				      textlen ) );
+	string line, key, name, type;
+
+	while (getline( header, line )) {
+	    istringstream words( line );
+	    words >> key;
+	    if (key == "rows") {
+		words >> _nrows;
+	    }
+	    else if (key == "schema") {
+		getline( words >> ws, _schema );
+	    }
+	    else if (key == "column") {
+		Column c;
+		uint64_t bytes;
+		c.heap = 0;
+		words >> name >> type >> c.offset;
+		if (type == "int") { 
+		    c.type = FIELD_INT; 
+		    bytes = _nrows*sizeof(int);
+		}
+		else if (type == "double") {
+		    c.type = FIELD_DOUBLE;
+		    bytes = _nrows*sizeof(double);
+		}
+		else if (type == "int64") {
+		    c.type = FIELD_INT64;
+		    bytes = _nrows*sizeof(int64_t);
+		}
+		else if (type == "float") {
+		    c.type = FIELD_FLOAT;
+		    bytes = _nrows*sizeof(float);
+		}
+		else if (type == "string") {
+		    c.type = FIELD_STRING;
+		    words >> c.heap;
+		    c.heap += data;
+		    bytes = (_nrows+1)*sizeof(uint64_t);
+		}
+		else throw runtime_error("ColumnSnapshot: unknown type '"
+					 +type+"' in '"+filename+"'");
+		if (!words) 
+		    throw runtime_error("ColumnSnapshot: bad header in '"
+					+filename+"'");
+		c.offset += data;
+		if (_nrows > _mapsize || c.offset > _mapsize 
+		    || bytes > _mapsize-c.offset || c.heap > _mapsize)
+		    throw runtime_error("ColumnSnapshot: '"+filename
+					+"' is truncated");
+		if (c.type == FIELD_STRING) {
+		    // every string must lie within the heap, i.e. the file
+		    const uint64_t *off = (const uint64_t*)(_map+c.offset);
+		    for (size_t i=0; i<_nrows; i++) {
+			if (off[i+1] < off[i])
+			    throw runtime_error("ColumnSnapshot: bad offsets "
+						"of '"+name+"' in '"
+						+filename+"'");
+		    }
+		    if (off[_nrows] > _mapsize-c.heap)
+			throw runtime_error("ColumnSnapshot: '"+filename
+					    +"' is truncated");
+		}
+		_columns[name] = c;
+	    }
+	}
+
+    }
+    catch (runtime_error &e) {
+	munmap( (void*)_map, _mapsize );
+	throw;
+    }
+
+}
+
+
+ColumnSnapshot::~ColumnSnapshot() {
+    munmap( (void*)_map, _mapsize );
+}
+
+
+/**
+ * \returns the text column of the given name
+ */
+StringColumn
+ColumnSnapshot::getStrings( const std::string &name ) const {
+    const Column &c = column( name, FIELD_STRING );
+    return StringColumn( (const uint64_t*)(_map+c.offset), _map+c.heap, 
+			 _nrows );
+}
+
+
+/**
+ * Returns the column of the given name, checking that it has the
+ * expected type.
+ */
+const ColumnSnapshot::Column &
+ColumnSnapshot::column( const std::string &name, 
+			DatabaseFieldType type ) const {
+
+    std::map< std::string, Column >::const_iterator it;
+
+    it = _columns.find( name );
+    if (it == _columns.end())
+	throw runtime_error("ColumnSnapshot: no column '"+name+"' in '"
+			    +_filename+"'");
+    if (it->second.type != type)
+	throw runtime_error("ColumnSnapshot: wrong type requested for '"
+			    +name+"'");
+    return it->second;
+
+}
@@ -0,0 +1,147 @@
+//
+// Memory-mapped columnar snapshots of DatabaseRecord tables
+//
+
+#ifndef COLUMNSNAPSHOT_H
+#define COLUMNSNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include "DatabaseRecord.h"
+
+/**
+ * A read-only view of one fixed-width column of a ColumnSnapshot
+ */
+template <class T>
+class ColumnSpan {
+
+ public:
+    ColumnSpan( const T *data=NULL, size_t n=0 ) : _data(data), _size(n) {;}
+
+    size_t size() const { return _size; }
+    const T *data() const { return _data; }
+    const T *begin() const { return _data; }
+    const T *end() const { return _data+_size; }
+    const T &operator[]( size_t i ) const { return _data[i]; }
+
+ private:
+    const T *_data;
+    size_t _size;
+
+};
+
+/**
+ * A read-only view of a text column of a ColumnSnapshot. Element i is
+ * a std::string_view into the mapped file.
+ */
+class StringColumn {
+
+ public:
+    StringColumn( const uint64_t *offsets=NULL, const char *heap=NULL,
+		  size_t n=0 ) : _offsets(offsets), _heap(heap), _size(n) {;}
+
+    size_t size() const { return _size; }
+    std::string_view operator[]( size_t i ) const {
+	return std::string_view( _heap+_offsets[i],
+				 _offsets[i+1]-_offsets[i] );
+    }
+
+ private:
+    const uint64_t *_offsets;
+    const char *_heap;
+    size_t _size;
+
+};
+
+
+/**
+ * A table that was written with ColumnSnapshot::write(), mapped into
+ * memory. The file holds a text header (row count, the table's
+ * schema and the position of each column) followed by one array per
+ * field, each aligned to 64 bytes. Opening a snapshot only reads the
+ * header; the columns are returned as views into the mapping, so no
+ * data is copied or decoded, and pages are read in by the OS as they
+ * are touched.  Example:
+ *
+ *	ColumnSnapshot::write( p, "paramdata.cols" );
+ *	...
+ *	ColumnSnapshot snap( "paramdata.cols" );
+ *	ColumnSpan<double> size = snap.get<double>("size");
+ *
+ * Files use the byte order of the machine that wrote them.
+ */
+class ColumnSnapshot {
+
+ public:
+
+    ColumnSnapshot( const std::string &filename );
+    ~ColumnSnapshot();
+
+    static size_t write( DatabaseRecord &rec, const std::string &filename,
+			 std::string where_clause="" );
+
+    /// number of rows
+    size_t size() const { return _nrows; }
+    /// schema of the table the snapshot was written from
+    const std::string &getSchema() const { return _schema; }
+    bool has( const std::string &name ) const {
+	return _columns.find(name) != _columns.end();
+    }
+
+    template <class T> ColumnSpan<T> get( const std::string &name ) const;
+    StringColumn getStrings( const std::string &name ) const;
+
+ private:
+
+    ColumnSnapshot( const ColumnSnapshot& );
+    ColumnSnapshot &operator=( const ColumnSnapshot& );
+
+    struct Column {
+	DatabaseFieldType type;
+	uint64_t offset;	//!< start of the array in the file
+	uint64_t heap;		//!< start of the text (strings only)
+    };
+
+    const Column &column( const std::string &name,
+			  DatabaseFieldType type ) const;
+
+    std::string _filename;
+    const char *_map;
+    size_t _mapsize;
+    size_t _nrows;
+    std::string _schema;
+    std::map< std::string, Column > _columns;
+
+};
+
+template <> inline ColumnSpan<int>
+ColumnSnapshot::get<int>( const std::string &name ) const {
+    return ColumnSpan<int>( (const int*)(_map+column(name,FIELD_INT).offset),
+			    _nrows );
+}
+
+template <> inline ColumnSpan<double>
+ColumnSnapshot::get<double>( const std::string &name ) const {
+    return ColumnSpan<double>( (const double*)
+			       (_map+column(name,FIELD_DOUBLE).offset),
+			       _nrows );
+}
+
+template <> inline ColumnSpan<int64_t>
+ColumnSnapshot::get<int64_t>( const std::string &name ) const {
+    return ColumnSpan<int64_t>( (const int64_t*)
+				(_map+column(name,FIELD_INT64).offset),
+				_nrows );
+}
+
+template <> inline ColumnSpan<float>
+ColumnSnapshot::get<float>( const std::string &name ) const {
+    return ColumnSpan<float>( (const float*)
+			      (_map+column(name,FIELD_FLOAT).offset),
+			      _nrows );
+}
+
+#endif
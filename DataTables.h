@@ -3,6 +3,7 @@
 #define DATATABLES_H
 
 #include "DatabaseRecord.h"
+#include "RecordSchema.h"
 
 
 // some simple helper structs:
@@ -61,39 +62,42 @@ struct ParamRecord : public DatabaseRecord {
 
     ParamRecord() : DatabaseRecord() {
 	setTableName("paramdata");
-	addField( "event_number", event_number );
-	addField( "telescope_id", telescope_id );
-	addField( "osctime",   osctime );
-	addField( "gpstime",   gpstime );
-	addField( "livetime",  livetime );
-	addField( "centroid_x", centroid.x );
-	addField( "centroid_y", centroid.y );
-	addField( "poo_a_x", point_of_origin_a.x );
-	addField( "poo_a_y", point_of_origin_a.y );
-	addField( "poo_b_x", point_of_origin_b.x );
-	addField( "poo_b_y", point_of_origin_b.y );
-	addField( "length", length );
-	addField( "width", width );
-	addField( "size", size );
-	addField( "miss", miss );
-	addField( "distance", distance );
-	addField( "azwidth", azwidth );
-	addField( "lensize", length_over_size );
-	addField( "psi", psi );
-	addField( "phi", phi );
-	addField( "max1", max[0] );
-	addField( "max2", max[1] );
-	addField( "max3", max[2] );
-	addField( "imax1", max[0] );
-	addField( "imax2", max[1] );
-	addField( "imax3", max[2] );
-	addField( "frac1", frac[0] );
-	addField( "frac2", frac[1] );
-	addField( "frac3", frac[2] );
-	addField( "pix_in_picture", pixels_in_picture );
-	addField( "asymmetry", asymmetry );
-	addField( "zenith", zenith );
-	addField( "e_est", energy_estimate );
+	setFields( schema(
+	    field( "event_number", &ParamRecord::event_number ),
+	    field( "telescope_id", &ParamRecord::telescope_id ),
+	    field( "osctime", &ParamRecord::osctime ),
+	    field( "gpstime", &ParamRecord::gpstime ),
+	    field( "livetime", &ParamRecord::livetime ),
+	    field( "invalid", &ParamRecord::invalid ),
+	    field( "centroid_x", &ParamRecord::centroid, &Coordinate_t::x ),
+	    field( "centroid_y", &ParamRecord::centroid, &Coordinate_t::y ),
+	    field( "poo_a_x", &ParamRecord::point_of_origin_a, &Coordinate_t::x ),
+	    field( "poo_a_y", &ParamRecord::point_of_origin_a, &Coordinate_t::y ),
+	    field( "poo_b_x", &ParamRecord::point_of_origin_b, &Coordinate_t::x ),
+	    field( "poo_b_y", &ParamRecord::point_of_origin_b, &Coordinate_t::y ),
+	    field( "length", &ParamRecord::length ),
+	    field( "width", &ParamRecord::width ),
+	    field( "size", &ParamRecord::size ),
+	    field( "miss", &ParamRecord::miss ),
+	    field( "distance", &ParamRecord::distance ),
+	    field( "azwidth", &ParamRecord::azwidth ),
+	    field( "lensize", &ParamRecord::length_over_size ),
+	    field( "psi", &ParamRecord::psi ),
+	    field( "phi", &ParamRecord::phi ),
+	    field( "max1", &ParamRecord::max, 0 ),
+	    field( "max2", &ParamRecord::max, 1 ),
+	    field( "max3", &ParamRecord::max, 2 ),
+	    field( "imax1", &ParamRecord::index_of_max, 0 ),
+	    field( "imax2", &ParamRecord::index_of_max, 1 ),
+	    field( "imax3", &ParamRecord::index_of_max, 2 ),
+	    field( "frac1", &ParamRecord::frac, 0 ),
+	    field( "frac2", &ParamRecord::frac, 1 ),
+	    field( "frac3", &ParamRecord::frac, 2 ),
+	    field( "pix_in_picture", &ParamRecord::pixels_in_picture ),
+	    field( "asymmetry", &ParamRecord::asymmetry ),
+	    field( "zenith", &ParamRecord::zenith ),
+	    field( "e_est", &ParamRecord::energy_estimate ) ) );
+	addIndex( {"event_number", "telescope_id"} );
 	zero();
     }
 
@@ -110,11 +114,12 @@ struct EZParamRecord : public DatabaseRecord {
 
     EZParamRecord() : DatabaseRecord() {
 	setTableName("ezparams");
-	addField( "event_number", event_number );
-	addField( "telescope_id", telescope_id );
-	addField( "ezlength", ezlength );
-	addField( "ezwidth", ezwidth );
-	addField( "ezsize", ezsize );
+	setFields( schema(
+	    field( "event_number", &EZParamRecord::event_number ),
+	    field( "telescope_id", &EZParamRecord::telescope_id ),
+	    field( "ezlength", &EZParamRecord::ezlength ),
+	    field( "ezwidth", &EZParamRecord::ezwidth ),
+	    field( "ezsize", &EZParamRecord::ezsize ) ) );
     }
 
 };
@@ -135,14 +140,16 @@ struct SimShowerRecord : public DatabaseRecord {
 
     SimShowerRecord() : DatabaseRecord() {
 	setTableName("simdata");
-	addField( "event_number",event_number );
-	addField( "telescope_id",telescope_id );
-	addField( "primary_type",primary_type );
-	addField( "primary_energy", primary_energy );
-	addField( "impact_param_x", impact_parameter.x );
-	addField( "impact_param_y", impact_parameter.y );
-	addField( "dir_cos_x",direction_cos.x );
-	addField( "dir_cos_y",direction_cos.y );
+	setFields( schema(
+	    field( "event_number", &SimShowerRecord::event_number ),
+	    field( "telescope_id", &SimShowerRecord::telescope_id ),
+	    field( "primary_type", &SimShowerRecord::primary_type ),
+	    field( "primary_energy", &SimShowerRecord::primary_energy ),
+	    field( "impact_param_x", &SimShowerRecord::impact_parameter, &Coordinate_t::x ),
+	    field( "impact_param_y", &SimShowerRecord::impact_parameter, &Coordinate_t::y ),
+	    field( "dir_cos_x", &SimShowerRecord::direction_cos, &Coordinate_t::x ),
+	    field( "dir_cos_y", &SimShowerRecord::direction_cos, &Coordinate_t::y ) ) );
+	addIndex( {"event_number", "telescope_id"} );
 	zero();
     }
 
@@ -168,16 +175,17 @@ struct HeaderRecord : public DatabaseRecord {
 
     HeaderRecord() : DatabaseRecord() {
 	setTableName("paramheader");
-	addField( "nadc", nadc );
-	addField( "ra", ra );
-	addField( "dec", dec );
-	addField( "starttime", starttime );
-	addField( "endtime", endtime );
-	addField( "average_elevation", average_elevation );
-	addField( "windowsize", windowsize );
-	addField( "sourcename", sourcename );
-	addField( "runid", runid );
-	addField( "pairid", pairid );
+	setFields( schema(
+	    field( "nadc", &HeaderRecord::nadc ),
+	    field( "ra", &HeaderRecord::ra ),
+	    field( "dec", &HeaderRecord::dec ),
+	    field( "starttime", &HeaderRecord::starttime ),
+	    field( "endtime", &HeaderRecord::endtime ),
+	    field( "average_elevation", &HeaderRecord::average_elevation ),
+	    field( "windowsize", &HeaderRecord::windowsize ),
+	    field( "sourcename", &HeaderRecord::sourcename ),
+	    field( "runid", &HeaderRecord::runid ),
+	    field( "pairid", &HeaderRecord::pairid ) ) );
 	zero();
     };
 
@@ -213,34 +221,37 @@ struct MuonRecord : public DatabaseRecord {
     double ycs;
     double rspread;
 
-    // not stored in database:
     int	nplotpoints ;		//!< number of ring positions
     Coordinate_t plot[MAX_PLOT_CENTERS]; //!< Array of ring center positions 
 
 
     MuonRecord () : DatabaseRecord () {
 	setTableName("muondata");
-	addField( "event_number", event_number );
-	addField( "telescope_id", telescope_id );
-	addField( "radius", radius);
-	addField( "ringcenter_x", ringcenter.x);
-	addField( "ringcenter_y", ringcenter.y);
-	addField( "arcstrength", arcstrength);
-	addField( "gain", gain);
-	addField( "mugain", mugain);
-	addField( "ringfrac", ringfrac);
-	addField( "soal", soal);
-	addField( "muskew", muskew);
-	addField( "arclen", arclen);
-	addField( "philo", philo);
-	addField( "phihi", phihi);
-	addField( "phimid", phimid);
-	addField( "muonness", muonness);
-	addField( "smoothness", smoothness);
-	addField( "smoothness_var", smoothness_var);
-	addField( "xcs", xcs);
-	addField( "ycs", ycs);
-	addField( "rspread", rspread);
+	setFields( schema(
+	    field( "event_number", &MuonRecord::event_number ),
+	    field( "telescope_id", &MuonRecord::telescope_id ),
+	    field( "radius", &MuonRecord::radius ),
+	    field( "ringcenter_x", &MuonRecord::ringcenter, &Coordinate_t::x ),
+	    field( "ringcenter_y", &MuonRecord::ringcenter, &Coordinate_t::y ),
+	    field( "arcstrength", &MuonRecord::arcstrength ),
+	    field( "gain", &MuonRecord::gain ),
+	    field( "mugain", &MuonRecord::mugain ),
+	    field( "ringfrac", &MuonRecord::ringfrac ),
+	    field( "soal", &MuonRecord::soal ),
+	    field( "muskew", &MuonRecord::muskew ),
+	    field( "arclen", &MuonRecord::arclen ),
+	    field( "philo", &MuonRecord::philo ),
+	    field( "phihi", &MuonRecord::phihi ),
+	    field( "phimid", &MuonRecord::phimid ),
+	    field( "muonness", &MuonRecord::muonness ),
+	    field( "smoothness", &MuonRecord::smoothness ),
+	    field( "smoothness_var", &MuonRecord::smoothness_var ),
+	    field( "xcs", &MuonRecord::xcs ),
+	    field( "ycs", &MuonRecord::ycs ),
+	    field( "rspread", &MuonRecord::rspread ),
+	    field( "plot", &MuonRecord::plot, &MuonRecord::nplotpoints ) ) );
+	setLazy( "plot" );	// use readBlob("plot") to read the plot
+	addIndex( {"event_number", "telescope_id"} );
 	zero();
     }
 };
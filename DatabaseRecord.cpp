@@ -10,381 +10,3056 @@
 #include <iomanip>
 #include <map>
 #include <sstream>
+#include <chrono>
+#include <cstdlib>
+#include <algorithm>
+#include <mutex>
+#include <set>
+#include <cctype>
+#include <cstring>
+#include <cmath>
+#include <random>
+#include <ctime>
 
 #include  "DatabaseRecord.h"
+#include  "RowQueue.h"
 using namespace std;
 
-/**
- * Call this to write the currently mapped values of your structure to
- * the database.
- */
-void DatabaseRecord::writeToDatabase() {
+typedef std::chrono::steady_clock stats_clock;
 
-    std::map< std::string, DatabaseField >::iterator it;
-    int i=1;
-    int ret;
+/// nanoseconds since start, for the performance counters
+static inline long long elapsedNs( stats_clock::time_point start ) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>
+	( stats_clock::now() - start ).count();
+}
 
-    if (_db == NULL) throw runtime_error("NO DATABASE CONNECTION!");
+// number and total time (ns) of the waits of this thread for locks
+// held by other connections
+static thread_local long long busy_waits = 0;
+static thread_local long long busy_wait_ns = 0;
 
-    if (_write_in_progress == false) {
-	prepareToWrite();
-    }
+/// give up on SQLITE_LOCKED after this long
+static const long long LOCKED_TIMEOUT_NS = 30000000000LL;
 
-    for (it=_fieldmap.begin(); it != _fieldmap.end(); it++) {
-	switch (it->second.type) {
-	case FIELD_INT:
-	    sqlite3_bind_int(_wrstmt, i, *((int*)it->second.ptr) );
-	    break;
-	case FIELD_DOUBLE:
-	    sqlite3_bind_double(_wrstmt, i, *((double*)it->second.ptr) );
-	    break;
-	case FIELD_STRING:
-	    sqlite3_bind_text(_wrstmt, i, 
-			      ((std::string*)it->second.ptr)->c_str(), 
-			      ((std::string*)it->second.ptr)->length(), 
-			      NULL );
-	    break;
-	}
-	i++;
-    }
 
-    ret = sqlite3_step(_wrstmt) ;
+/**
+ * Sleep before retry number attempt (0,1,2,...) of an operation that
+ * found the database locked. The delay grows exponentially from 0.1
+ * ms to 100 ms, and a random part of it (up to half) is left out, so
+ * competing writers don't all wake up and retry at the same moment.
+ *
+ * \returns the time slept, in ns
+ */
+static long long backoff( int attempt ) {
 
-    // handle errors.  This is somewhat messy, but seems to work ok.
-    // For some reason, you sometimes get a error when writing two
-    // different tables in succession.  Re-trying seems to fix it.  I
-    // bail out after an arbitrary number of tries, just in case it
-    // becomes an infinite loop
+    static thread_local std::minstd_rand 
+	rng( std::hash<std::thread::id>()( std::this_thread::get_id() ) 
+	     ^ (unsigned) time(NULL) );
 
-    if (ret != SQLITE_DONE) {
-	if (ret == SQLITE_ERROR || ret == SQLITE_SCHEMA) {
-	    cout << "DEBUG: write error: '"<<sqlite3_errmsg(_db)
-		 <<"', attempting to re-issue write.."	 <<endl;
-	    _badcount++; 
-	    if (_badcount > 1000) {
-		throw runtime_error("writeToDatabase() bailing out due "
-				    "to too many bad writes on '"
-				    +_tablename+"': "+sqlite3_errmsg(_db));
-	    }
-	    finish();
-	    writeToDatabase();
-	    return;
-	} 
-	else {
-	    cout << "DEBUG: writeToDatabase() ret="<<ret<<endl;
-	    throw runtime_error("writeToDatabase() on '"+_tablename+"': "
-			    +sqlite3_errmsg(_db));
-	}
-    }
-    sqlite3_reset(_wrstmt);
-    _writecount++;
+    long long cap_us = 100LL << std::min( attempt, 10 );
+    if (cap_us > 100000) cap_us = 100000;
+    long long delay_us = cap_us/2 + rng() % (cap_us/2 + 1);
+
+    stats_clock::time_point t0 = stats_clock::now();
+    std::this_thread::sleep_for( std::chrono::microseconds(delay_us) );
+    long long ns = elapsedNs(t0);
+
+    busy_waits++;
+    busy_wait_ns += ns;
+    return ns;
 
 }
 
 
 /**
- * Returns an SQL schema string for the table
+ * sqlite busy handler installed by setBusyTimeout(): back off and
+ * retry, until the lock has been waited for for the given number of
+ * milliseconds.
  */
-string DatabaseRecord::getSchema() {
+static int busyHandler( void *timeout_ms, int count ) {
 
-    vector<string> fields;
-    string tmp;
-    std::map< std::string, DatabaseField >::iterator it;
+    static thread_local long long waited_ns = 0;
 
-    for (it=_fieldmap.begin(); it != _fieldmap.end(); it++) {
-	if (it->second.primary_key==true) 
-	    tmp ="PRIMARY KEY";
-	else tmp = "";
+    if (count == 0) waited_ns = 0;  // a new locking event
+    if (waited_ns >= (intptr_t)timeout_ms * 1000000LL) return 0;
+    waited_ns += backoff( count );
+    return 1;
+
+}
 
-	switch (it->second.type) {
-	case FIELD_INT:
-	    fields.push_back( it->first + " INTEGER " + tmp );
-	    break;
-	case FIELD_DOUBLE:
-	    fields.push_back( it->first + " DOUBLE " + tmp );
-	    break;
-	case FIELD_STRING:
-	    fields.push_back( it->first + " TEXT " +tmp );
-	    break;
-	}
 
+/**
+ * Counts the lock waits of the current thread while it exists, and
+ * adds them to a record's performance counters.
+ */
+class BusyWatch {
+
+ public:
+    BusyWatch( StatCounter &waits, StatCounter &ns ) 
+	: _waits(waits), _ns(ns), _waits0(busy_waits), _ns0(busy_wait_ns) {;}
+    ~BusyWatch() {
+	if (busy_waits != _waits0) {
+	    _waits.add( busy_waits-_waits0 );
+	    _ns.add( busy_wait_ns-_ns0 );
+	}
     }
 
-    return join( ", ",fields ); 
+ private:
+    StatCounter &_waits, &_ns;
+    long long _waits0, _ns0;
+
+};
 
-}
 
 /**
- * \returns a list of all mapped fields, separated by commas
+ * Holds the mutex of a connection while it exists. Records writing
+ * through the same connection from several threads (see
+ * setAsyncWrite()) take it around everything that must not be
+ * interleaved: an insert and its error message, and the check,
+ * COMMIT and BEGIN of the transaction. It is recursive, and is only
+ * there in sqlite's serialized threading mode (otherwise it does
+ * nothing, and the connection must be used from one thread).
  */
-string DatabaseRecord::getFieldList() {
-    vector<string> fields;
-    std::map< std::string, DatabaseField >::iterator it;
-    for (it=_fieldmap.begin(); it != _fieldmap.end(); it++) {
-	fields.push_back(it->first);
+class ConnectionLock {
+
+ public:
+    ConnectionLock( database_t db ) : _mutex( sqlite3_db_mutex(db) ) {
+	sqlite3_mutex_enter( _mutex );
     }
+    ~ConnectionLock() { sqlite3_mutex_leave( _mutex ); }
 
-    return join(", ",fields );
-}
+ private:
+    ConnectionLock( const ConnectionLock& );
+    ConnectionLock &operator=( const ConnectionLock& );
+    sqlite3_mutex *_mutex;
 
+};
 
 
 /**
- * prepare to read from the database. This should be called before
- * calling readFromDatabase(). You can specify an optional "WHERE"
- * clause to limit the results.
+ * Make the connection wait, for up to msec milliseconds, when the
+ * database is locked by another connection (e.g. another process
+ * writing the same file), instead of failing with "database is
+ * locked". While waiting, it retries with exponential backoff and
+ * jitter. msec=0 turns waiting off. Database does this for you (see
+ * DatabaseOptions::busy_timeout); call it yourself for handles opened
+ * with sqlite3_open().
  */
-void 
-DatabaseRecord::prepareToRead( std::string where_clause ) {
+void setBusyTimeout( database_t db, int msec ) {
+
+    if (msec > 0) 
+	sqlite3_busy_handler( db, busyHandler, (void*)(intptr_t) msec );
+    else
+	sqlite3_busy_handler( db, NULL, NULL );
+
+}
+
+/**
+ * Choose how safely data is written, by setting the journal mode,
+ * sync level and WAL checkpoint interval of the connection:
+ *
+ * - DURABILITY_DEFAULT: rollback journal, full sync (sqlite defaults)
+ * - DURABILITY_BULK_LOAD: write-ahead log, no sync and a checkpoint
+ *   only every 10000 pages. Survives a crash of the program, but not
+ *   of the operating system.
+ * - DURABILITY_SAFE: write-ahead log, full sync, checkpoint every 1000
+ *   pages. Committed data survives power loss.
+ * - DURABILITY_IN_MEMORY: journal kept in memory, no sync. A crash may
+ *   corrupt the file; use for scratch data or ":memory:" databases.
+ *
+ * Should be called before any records start writing. Combine with
+ * DatabaseRecord::setCommitPolicy() to limit how much is lost.
+ */
+void Database::setDurability( DurabilityProfile profile ) {
 
     string sql;
-    int ret;
 
-    if (_db == NULL) throw runtime_error("NO DATABASE CONNECTION!");
+    switch (profile) {
+    case DURABILITY_DEFAULT:
+	sql = "PRAGMA journal_mode=DELETE; PRAGMA synchronous=FULL;";
+	break;
+    case DURABILITY_BULK_LOAD:
+	sql = "PRAGMA journal_mode=WAL; PRAGMA synchronous=OFF; "
+	    "PRAGMA wal_autocheckpoint=10000;";
+	break;
+    case DURABILITY_SAFE:
+	sql = "PRAGMA journal_mode=WAL; PRAGMA synchronous=FULL; "
+	    "PRAGMA wal_autocheckpoint=1000;";
+	break;
+    case DURABILITY_IN_MEMORY:
+	sql = "PRAGMA journal_mode=MEMORY; PRAGMA synchronous=OFF;";
+	break;
+    }
 
-    sql = "SELECT "+getFieldList()+" FROM "+_tablename;
-    if (where_clause != "") {
-	sql.append(" WHERE "+where_clause );
+    if (sqlite3_exec( _db, sql.c_str(), NULL, NULL, NULL ) != SQLITE_OK) {
+	throw runtime_error("setDurability(): '"+sql+"': "
+			    +sqlite3_errmsg(_db));
     }
 
-    ret = sqlite3_prepare( _db, sql.c_str(), sql.length(), &_rdstmt, NULL );
-    if (ret!= SQLITE_OK) {
-	throw runtime_error("prepareToRead(): couldn't prepare '"+sql+
-			    "': "+sqlite3_errmsg(_db) );
+}
+
+
+/**
+ * Apply connection settings (see DatabaseOptions). This is done by
+ * the constructor, but can be repeated later (though the page size of
+ * an existing file can't be changed this way).
+ */
+void Database::setOptions( const DatabaseOptions &opt ) {
+
+    ostringstream sql;
+
+    // page_size has to come before the journal mode is switched to WAL
+    if (opt.page_size > 0) sql << "PRAGMA page_size="<<opt.page_size<<";";
+    if (opt.cache_kb >= 0) sql << "PRAGMA cache_size=-"<<opt.cache_kb<<";";
+    if (opt.mmap_size >= 0) sql << "PRAGMA mmap_size="<<opt.mmap_size<<";";
+    if (opt.temp_store >= 0) sql << "PRAGMA temp_store="<<opt.temp_store<<";";
+    if (opt.threads >= 0) sql << "PRAGMA threads="<<opt.threads<<";";
+    if (opt.exclusive) sql << "PRAGMA locking_mode=EXCLUSIVE;";
+    if (opt.wal) sql << "PRAGMA journal_mode=WAL;";
+
+    if (opt.busy_timeout >= 0) {
+	setBusyTimeout( _db, opt.busy_timeout );
+	_busy_timeout = opt.busy_timeout;
     }
 
-    _read_in_progress=true;
+    if (sql.str() == "") return;
+
+    if (sqlite3_exec( _db, sql.str().c_str(), NULL, NULL, NULL ) != SQLITE_OK) {
+	throw runtime_error("setOptions(): '"+sql.str()+"': "
+			    +sqlite3_errmsg(_db));
+    }
 
 }
 
 
 /**
- * Automatically called the first time writeToDatabase() is called
+ * \returns the connection settings currently in effect
  */
-void 
-DatabaseRecord::prepareToWrite() {
-    
-    if (_db == NULL) throw runtime_error("NO DATABASE CONNECTION!");
+DatabaseOptions Database::getOptions() {
 
-    if (tableExists() == false) {
-	cout << "DatabaseRecord: Table '"
-	     <<_tablename<<"' doesn't exist, creating it..."<<endl;
-	createTable();
-    }
+    DatabaseOptions opt;
+    sqlite3_int64 cache;
 
-    string sql = "INSERT INTO "+_tablename+" ("+getFieldList()+") VALUES (";
+    opt.page_size = pragma("page_size");
+    cache = pragma("cache_size"); // pages if positive, KiB if negative
+    opt.cache_kb = (cache < 0) ? -cache : cache*opt.page_size/1024;
+    opt.mmap_size = pragma("mmap_size");
+    opt.temp_store = pragma("temp_store");
+    opt.threads = pragma("threads");
+    opt.exclusive = (pragmaText("locking_mode") == "exclusive");
+    opt.wal = (pragmaText("journal_mode") == "wal");
+    opt.busy_timeout = _busy_timeout;
 
-    vector<string> tmp;
-    for (int i=0; i<getNumFields(); i++) {
-	tmp.push_back("?");
-    }
+    return opt;
 
-    sql.append( join(",",tmp) );
-    sql.append(")");
+}
 
-    if(sqlite3_prepare( _db, sql.c_str(), sql.length(), &_wrstmt, NULL ) 
-       != SQLITE_OK) {
-	throw runtime_error("prepareToWrite(): sql error with '"+sql+"': "
-			    +sqlite3_errmsg(_db));
-    }
 
-    sqlite3_exec( _db, "BEGIN TRANSACTION", NULL, NULL, NULL );
+/**
+ * \returns the value of an integer PRAGMA
+ */
+sqlite3_int64 Database::pragma( const std::string &name ) {
 
-    _write_in_progress= true;
+    string text = pragmaText( name );
+    return strtoll( text.c_str(), NULL, 10 );
 
 }
 
 
 /**
- * End all database transactions.  This is called automatically when a
- * DatabaseRecord is deleted, but can be called manually if needed to
- * finish up the output.
+ * \returns the value of a PRAGMA, as text
  */
-void
-DatabaseRecord::finish() {
+string Database::pragmaText( const std::string &name ) {
 
-    if (_write_in_progress &&  _db) {
-	sqlite3_exec( _db, "END TRANSACTION", NULL, NULL, NULL );
-	if (sqlite3_finalize( _wrstmt )) 
-	    cout <<"ERROR: couldn't finalize "<<_tablename<<": "
-		 <<sqlite3_errmsg(_db)<<endl;
-	_write_in_progress= false;
-	cout <<"DEBUG: finished writing "<<_writecount<<" rows to '"
-	     << _tablename << "'"  <<endl;
+    string sql = "PRAGMA "+name;
+    string value;
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2( _db, sql.c_str(), sql.length(), &stmt, NULL )
+	!= SQLITE_OK) {
+	throw runtime_error("'"+sql+"': "+sqlite3_errmsg(_db));
     }
-    if (_read_in_progress && _db) {
-	cout << "DEBUG: finalizing reading on '"<<_tablename<<"'"<<endl;
-	if(sqlite3_finalize( _rdstmt ))
-	    cout <<"ERROR: couldn't finalize "<<_tablename<<": "
-		 <<sqlite3_errmsg(_db)<<endl;
-	_read_in_progress=false;
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt,0)) {
+	value = (const char*) sqlite3_column_text(stmt,0);
     }
+    sqlite3_finalize(stmt);
 
-    
+    return value;
+
+}
+
+
+std::ostream& operator<<( std::ostream &stream, const DatabaseOptions &opt ) {
+    stream << "page_size:  " << opt.page_size << endl
+	   << "cache_kb:  " << opt.cache_kb << endl
+	   << "mmap_size:  " << opt.mmap_size << endl
+	   << "temp_store:  " << opt.temp_store << endl
+	   << "threads:  " << opt.threads << endl
+	   << "exclusive:  " << opt.exclusive << endl
+	   << "wal:  " << opt.wal << endl
+	   << "busy_timeout:  " << opt.busy_timeout << endl;
+    return stream;
 }
 
 
 /**
- * You must have called prepareToRead() before calling this.
- * Thereafter, each time readFromDatabase is called, the mapped values
- * of your subclass will be updated with the next row of the database. 
- *
- * \returns 0 if no more rows are available, 1 if a row was read successfully.
+ * Call this to write the currently mapped values of your structure to
+ * the database.
  */
-int
-DatabaseRecord:: 
-readFromDatabase() {
+void DatabaseRecord::writeToDatabase() {
 
-    std::map< std::string, DatabaseField >::iterator it;
-    int i=0;
-    int ret;
+    size_t nbytes;
 
     if (_db == NULL) throw runtime_error("NO DATABASE CONNECTION!");
 
-    ret = sqlite3_step(_rdstmt) ;
-    if (ret == SQLITE_ROW) {
+    if (_write_in_progress == false) {
+	prepareToWrite();
+    }
 
-	for (it=_fieldmap.begin(); it != _fieldmap.end(); it++) {
-	    switch (it->second.type) {
-	    case FIELD_INT:
-		*((int*)it->second.ptr) = sqlite3_column_int(_rdstmt,i);
-		break;
-	    case FIELD_DOUBLE:
-		*((double*)it->second.ptr) = sqlite3_column_double(_rdstmt,i);
-		break;
-	    case FIELD_STRING:
-		*((std::string*)(it->second.ptr))
-		    =(const char*) sqlite3_column_text(_rdstmt,i);
-		break;
-	    }
-	    i++;
+    if (_queue != NULL) {
+	DatabaseRow *slot;
+	while ((slot = _queue->back()) == NULL) {
+	    if (_queue->failed()) break;
+	    std::this_thread::yield();
 	}
-	sqlite3_reset(_wrstmt);
-	return 1;
-    }
-    else if (ret==SQLITE_DONE) {
-	return 0;
+	if (_queue->failed()) {
+	    throw runtime_error("writeToDatabase() on '"+_tablename+"': "
+				+_queue->error());
+	}
+	snapshot( *slot );
+	_queue->push();
+	return;
     }
-    else{
-	throw runtime_error(string("readFromDatabase() step: ")
-			    +sqlite3_errmsg(_db));
-	return 0;
+
+    if (_batchstmt != NULL) {
+	snapshot( _batch[_batchfill] );
+	_batchfill++;
+	if (_batchfill == _batchsize) flushBatch();
+	return;
     }
 
+    stats_clock::time_point t0 = stats_clock::now();
+    nbytes = bindFields( _wrstmt, 1 );
+    _bind_ns.add( elapsedNs(t0) );
+    ConnectionLock lock( _db );
+    stepInsert( _wrstmt );
+    rowsWritten( 1, nbytes );
+
 }
 
 
 /**
- * Create the table in the database
+ * By default, std::string_view fields read by readFromDatabase() point
+ * into sqlite's copy of the current row and become invalid at the
+ * next read. With the arena on, the text is instead copied into a
+ * block of memory owned by the record, and the views stay valid until
+ * clearStringArena() is called or the record is destroyed. This is
+ * much cheaper than std::string fields when many values are kept.
  */
-void DatabaseRecord::createTable() {
-    
-    string sql;
-
-    if (_tablename == "")
-	throw runtime_error("createTable: No table name specified");
+void DatabaseRecord::useStringArena( bool enable ) {
 
-    if (tableExists()) {
-	cout << "WARNING: table '"<<_tablename<<"' already exists in datafile"
-	     << ", dropping it..."<<endl;
-	sql = "DROP TABLE "+_tablename;
-	sqlite3_exec( _db, sql.c_str(), NULL,NULL,NULL );
+    if (enable && _arena == NULL) _arena = new StringArena;
+    if (!enable && _arena) {
+	delete _arena;
+	_arena = NULL;
     }
 
+}
 
-    sql = "CREATE TABLE "+_tablename+" ("+ getSchema() +")";
-    
-    int ret;
 
-    cout <<"DEBUG: creating table: "<< _tablename << endl;
+/**
+ * Release the text of all std::string_view fields stored in the
+ * string arena (see useStringArena()). Views read before are invalid
+ * afterwards.
+ */
+void DatabaseRecord::clearStringArena() {
+    if (_arena) _arena->clear();
+}
+
 
-    ret = sqlite3_exec( _db, sql.c_str(), NULL, NULL, NULL );
+/**
+ * Copy n bytes into the arena
+ *
+ * \returns a view of the copy
+ */
+std::string_view StringArena::store( const char *data, size_t n ) {
 
-    if (ret != SQLITE_OK) {
-	throw runtime_error("createTable(): "+sql+": "+sqlite3_errmsg(_db));
+    if (n > _blocksize) {
+	_large.push_back( std::vector<char>( data, data+n ) );
+	return std::string_view( _large.back().data(), n );
+    }
+
+    if (_blocks.empty() || _used + n > _blocksize) {
+	if (_blocks.empty() == false) _current++;
+	if (_current == _blocks.size()) 
+	    _blocks.push_back( std::vector<char>(_blocksize) );
+	_used = 0;
     }
 
+    char *dest = _blocks[_current].data() + _used;
+    std::copy( data, data+n, dest );
+    _used += n;
+    return std::string_view( dest, n );
+
 }
 
 
 /**
- * Returns true if the table set by setTableName() exists in the database.
+ * Forget all stored strings. The memory is kept for reuse.
  */
-bool DatabaseRecord::tableExists() {
-    
-    string sql = "SELECT * FROM "+_tablename+" LIMIT 1";
+void StringArena::clear() {
 
-    if (_db == NULL) throw runtime_error("NO DATABASE CONNECTION!");
+    _large.clear();
+    _current = 0;
+    _used = 0;
 
-    if (sqlite3_exec( _db, sql.c_str(), NULL,NULL,NULL) ==SQLITE_OK)
-	return true;
-    else 
-	return false;
-    
 }
 
 
 /**
- * clear all the entries in the table (new writes are usually appended)
+ * Read only the given fields in future reads (from the next
+ * prepareToRead() on), e.g.
+ *
+ *	p.setProjection( {"size","width","distance"} );
+ *
+ * Only these columns are selected and decoded by readFromDatabase();
+ * the other mapped variables are left as they are. An empty list
+ * (the default) reads all fields again. A read in progress is ended.
  */
-void 
-DatabaseRecord::
-clearTable() {
-    
-    if (_db == NULL) throw runtime_error("NO DATABASE CONNECTION!");
+void DatabaseRecord::setProjection( const std::vector<std::string> &fields ) {
 
-    if (tableExists()) {
-	cout << "DEBUG: clearing table '"<<_tablename<<"'"<<endl;
-	string sql = "DELETE FROM "+_tablename;
-	if (sqlite3_exec( _db, sql.c_str(), NULL,NULL,NULL ) != SQLITE_OK){
-	    throw runtime_error("clearTable(): '"+sql+"': "
-				+sqlite3_errmsg(_db));
-	}
+    for (size_t i=0; i<fields.size(); i++) {
+	if (_fieldmap->find( fields[i] ) == _fieldmap->end()) 
+	    throw runtime_error("setProjection(): no field '"+fields[i]
+				+"' in '"+_tablename+"'");
     }
 
+    if (_read_in_progress) endRead();
+
+    _projection_request = fields;
+    updateProjection();
+
 }
 
 
 /**
- * Returns the number of rows in the database.
- *
- * \param where: an SQL "where" clause.  If not specified, all rows are counted.
+ * Work out which fields are selected by reads: those given to
+ * setProjection() (or else all of them), leaving out lazy fields
+ * unless they were asked for by name. If there are lazy fields, the
+ * rowid is selected after the fields, for readBlob().
  */
-int 
-DatabaseRecord::
-count(std::string where) {
-    string sql = "SELECT count() FROM "+_tablename;
-    sqlite3_stmt *stmt;
-    int c;
+void DatabaseRecord::updateProjection() {
 
-    if (_db == NULL) throw runtime_error("NO DATABASE CONNECTION!");
+    std::map< std::string, DatabaseField >::iterator it;
+    bool lazy = false;
 
-    if (where!="") sql.append(" WHERE "+where);
+    _projection.clear();
+    _projection_names.clear();
+    _rowid_col = -1;
 
-    sqlite3_prepare(_db,sql.c_str(),sql.length(),&stmt,NULL);
-    sqlite3_step(stmt);
-    c=sqlite3_column_int(stmt,0);
-    sqlite3_finalize(stmt);
-    
-    return c;
+    for (it=_fieldmap->begin(); it != _fieldmap->end(); it++) {
+	if (it->second.lazy) lazy = true;
+    }
 
-}
+    if (_projection_request.empty()) {
+	if (lazy == false) return;
+	for (it=_fieldmap->begin(); it != _fieldmap->end(); it++) {
+	    if (it->second.lazy) continue;
+	    _projection.push_back( &it->second );
+	    _projection_names.push_back( it->first );
+	}
+    }
+    else {
+	for (size_t i=0; i<_projection_request.size(); i++) {
+	    it = _fieldmap->find( _projection_request[i] );
+	    _projection.push_back( &it->second );
+	    _projection_names.push_back( it->first );
+	}
+    }
 
-string join( std::string delim, std::vector< std::string > &strvect ) {
-    int i;
-    string str;
+    if (lazy) _rowid_col = _projection.size();
 
-    if (strvect.size() == 1) { return strvect[0]; }
-    for (i=0; i<strvect.size()-1; i++) {
-	str.append(strvect[i]+delim);
-    }
-    str.append(strvect[i]);
-    return str;
 }
 
 
 /**
- * Prints out all currently mapped values. Just helpful for debugging. 
+ * Leave an array field out of future reads (from the next
+ * prepareToRead() on), e.g.
+ *
+ *	m.setLazy( "plot" );
+ *	m.prepareToRead();
+ *	while (m.readFromDatabase()) {
+ *	    if (m.muonness > 0.8) m.readBlob( "plot" );
+ *	}
+ *
+ * readFromDatabase() then leaves the array (and its count) as they
+ * are, and readBlob() reads it for the current row when it is needed,
+ * so large arrays cost nothing for rows where they aren't used.
+ * readAll() and DatabaseJoin don't read lazy fields at all.  Naming
+ * the field in setProjection() reads it with the rest of the row
+ * again. A read in progress is ended.
+ */
+void DatabaseRecord::setLazy( const std::string &field, bool lazy ) {
+
+    std::map< std::string, DatabaseField >::iterator it;
+
+    it = _fieldmap->find( field );
+    if (it == _fieldmap->end()) 
+	throw runtime_error("setLazy(): no field '"+field+"' in '"
+			    +_tablename+"'");
+    if (it->second.type != FIELD_BLOB)
+	throw runtime_error("setLazy(): '"+field+"' is not an array field");
+
+    if (_read_in_progress) endRead();
+
+    mutableFieldMap()[field].lazy = lazy;
+    updateProjection();
+
+}
+
+
+/**
+ * Read a field left out by setLazy() for the current row, i.e. the
+ * one last returned by readFromDatabase(). Only the blob itself is
+ * read, directly into the array, through an sqlite blob handle that
+ * is moved from row to row and closed when the read ends.
+ *
+ * \returns false if the row has no blob for the field (e.g. it was
+ * written before the field was added), in which case the array is
+ * emptied.
+ */
+bool DatabaseRecord::readBlob( const std::string &field ) {
+
+    std::map< std::string, DatabaseField >::iterator it;
+    int ret = SQLITE_OK;
+
+    it = _fieldmap->find( field );
+    if (it == _fieldmap->end() || it->second.type != FIELD_BLOB) 
+	throw runtime_error("readBlob(): no array field '"+field+"' in '"
+			    +_tablename+"'");
+    if (_read_in_progress == false || _rowid_col < 0)
+	throw runtime_error("readBlob(): no row of '"+_tablename
+			    +"' read with lazy fields");
+
+    const DatabaseField &f = it->second;
+    sqlite3_blob *&blob = _blobs[field];
+
+    if (blob && sqlite3_blob_reopen( blob, _rdrowid ) != SQLITE_OK) {
+	sqlite3_blob_close( blob );
+	blob = NULL;
+    }
+    if (blob == NULL)
+	ret = sqlite3_blob_open( _db, "main", _tablename.c_str(), 
+				 field.c_str(), _rdrowid, 0, &blob );
+    if (ret == SQLITE_ERROR) {
+	// not a blob (NULL), or the row is gone
+	fetchBlob( f, NULL, 0, *this );
+	return false;
+    }
+    if (ret != SQLITE_OK) 
+	throw runtime_error(string("readBlob(): ")+sqlite3_errmsg(_db));
+
+    size_t nbytes = sqlite3_blob_bytes( blob );
+    if (nbytes > f.size) nbytes = f.size;
+    if (sqlite3_blob_read( blob, fieldPtr(f), nbytes, 0 ) != SQLITE_OK)
+	throw runtime_error(string("readBlob(): ")+sqlite3_errmsg(_db));
+    fetchBlob( f, fieldPtr(f), nbytes, *this );
+    return true;
+
+}
+
+
+/**
+ * Close the blob handles opened by readBlob()
+ */
+void DatabaseRecord::closeBlobs() {
+
+    std::map< std::string, sqlite3_blob* >::iterator it;
+
+    for (it=_blobs.begin(); it != _blobs.end(); it++) {
+	if (it->second) sqlite3_blob_close( it->second );
+    }
+    _blobs.clear();
+
+}
+
+
+/**
+ * Map an array of n elements of elemsize bytes each as one BLOB
+ * column (see the addField() templates). If count is given, only the
+ * first count elements are written, and reading sets count to the
+ * number of elements read; otherwise all n elements are. The array is
+ * bound in place rather than copied, so the elements must be plain
+ * data (numbers, or structs of numbers), and are stored in the byte
+ * order of the machine.
+ */
+void DatabaseRecord::addBlob( const std::string &name, void *array,
+			      size_t elemsize, size_t n, int *count ) {
+
+    DatabaseField f;
+    f.offset = (char*) array - (char*) this;
+    f.type = FIELD_BLOB;
+    f.size = elemsize*n;
+    f.elemsize = elemsize;
+    if (count) f.count_offset = (char*) count - (char*) this;
+    mutableFieldMap()[name] = f;
+    _codec = NULL;
+
+}
+
+
+/**
+ * \returns the number of bytes of an array field to write, i.e. the
+ * whole array, or its first count elements
+ */
+size_t DatabaseRecord::blobBytes( const DatabaseField &field ) {
+
+    if (field.count_offset < 0) return field.size;
+
+    int n = *((int*)((char*) this + field.count_offset));
+    if (n <= 0) return 0;
+    return std::min( n*field.elemsize, field.size );
+
+}
+
+
+/**
+ * Copy nbytes of blob data (which may be NULL) into the array field
+ * of dest, and set its count. Without a count, the rest of the array
+ * is cleared.
+ */
+void DatabaseRecord::fetchBlob( const DatabaseField &field, const void *data,
+				size_t nbytes, DatabaseRecord &dest ) {
+
+    char *ptr = (char*) dest.fieldPtr( field );
+
+    if (data == NULL) nbytes = 0;
+    if (nbytes > field.size) nbytes = field.size;
+    if (nbytes && data != ptr) memcpy( ptr, data, nbytes );
+
+    if (field.count_offset >= 0)
+	*((int*)((char*) &dest + field.count_offset)) = nbytes/field.elemsize;
+    else if (nbytes < field.size)
+	memset( ptr+nbytes, 0, field.size-nbytes );
+
+}
+
+
+/**
+ * Make a copy of other's field values and settings (table, field
+ * mapping, indexes, batch size, commit policy, ...). The copy is not
+ * connected to a database; call setDatabaseHandle() before using it
+ * for reading or writing. std::string_view fields of the copy point at
+ * the same text as other's.
+ */
+DatabaseRecord::DatabaseRecord( const DatabaseRecord &other )
+    : _db(NULL), _rdstmt(NULL), _wrstmt(NULL), _batchstmt(NULL),
+      _tablename(other._tablename), _fieldmap(other._fieldmap),
+      _rowid_col(-1), _rdrowid(0),
+      _write_in_progress(false), _read_in_progress(false), _writecount(0),
+      _batchsize(other._batchsize), _batchfill(0),
+      _codec(other._codec), _use_codec(other._use_codec),
+      _commit_rows(other._commit_rows), _commit_bytes(other._commit_bytes),
+      _commit_msec(other._commit_msec), _pending_rows(0), _pending_bytes(0),
+      _asyncslots(other._asyncslots), _queue(NULL), _writer(NULL),
+      _prefetchslots(other._prefetchslots), _rdqueue(NULL), _reader(NULL),
+      _rdrow(NULL), _arena(NULL), _indexes(other._indexes),
+      _defer_indexes(other._defer_indexes), _indexes_dropped(false) {
+
+    if (other._rowid_col >= 0) updateProjection();	// lazy fields
+
+}
+
+
+/**
+ * Assignment leaves the record as it is: its connection, settings
+ * and any read or write in progress are kept. The mapped values are
+ * members of the subclass, so its (implicit) operator= copies them,
+ * e.g.
+ *
+ *	p = rows[i];
+ *	p.writeToDatabase();	// p's table, connection and batch
+ */
+DatabaseRecord &DatabaseRecord::operator=( const DatabaseRecord & ) {
+    return *this;
+}
+
+
+/**
+ * Read all rows matching where_clause, each into the record returned
+ * by append(), which must be of the same class as this one (see
+ * readAll()).  Uses its own statement, so a read started with
+ * prepareToRead() is not affected.
+ *
+ * \returns the number of rows read
+ */
+size_t DatabaseRecord::readInto( const std::function<DatabaseRecord&()> &append,
+				 std::string where_clause,
+				 const QueryParams &params ) {
+
+    string sql;
+    sqlite3_stmt *stmt;
+    size_t n=0;
+    int ret;
+
+    if (_db == NULL) throw runtime_error("NO DATABASE CONNECTION!");
+
+    for (std::map< std::string, DatabaseField >::iterator it=_fieldmap->begin();
+	 it != _fieldmap->end(); it++) {
+	if (it->second.type == FIELD_STRING_VIEW && _arena == NULL)
+	    throw runtime_error("readAll(): '"+_tablename+"' has string_view "
+				"fields, which need useStringArena()");
+    }
+
+    flushWrites();
+
+    sql = readSQL( where_clause );
+    stmt = _cache.acquire( _db, sql );
+    if (stmt == NULL) {
+	throw runtime_error("readAll(): couldn't prepare '"+sql+
+			    "': "+sqlite3_errmsg(_db) );
+    }
+
+    try {
+	bindParams( stmt, params );
+	while ((ret = sqlite3_step( stmt )) == SQLITE_ROW) {
+	    fetchRow( append(), stmt );
+	    n++;
+	}
+	if (ret != SQLITE_DONE) 
+	    throw runtime_error(string("readAll() step: ")+sqlite3_errmsg(_db));
+    }
+    catch (runtime_error &e) {
+	_cache.release( sql, stmt );
+	throw;
+    }
+    _cache.release( sql, stmt );
+    _rows_read.add( n );
+
+    return n;
+
+}
+
+
+/**
+ * Records whose fields were mapped with setFields() use code
+ * generated for their field types to bind and read values. This
+ * turns that off (or back on), so the generic field map code is used
+ * instead. Mostly useful for benchmarking and debugging.
+ */
+void DatabaseRecord::setStaticBinding( bool enable ) {
+    _use_codec = enable;
+}
+
+
+/**
+ * Bind the current values of all mapped fields to the parameters of
+ * stmt, starting with parameter number first.
+ *
+ * \returns the number of bytes bound
+ */
+size_t DatabaseRecord::bindFields( sqlite3_stmt *stmt, int first ) {
+
+    std::map< std::string, DatabaseField >::iterator it;
+    int i=first;
+    size_t nbytes=0;
+
+    if (_codec && _use_codec) {
+	return _codec->bind( *this, stmt, first );
+    }
+
+    for (it=_fieldmap->begin(); it != _fieldmap->end(); it++) {
+	switch (it->second.type) {
+	case FIELD_INT:
+	    sqlite3_bind_int(stmt, i, *((int*)fieldPtr(it->second)) );
+	    nbytes += sizeof(int);
+	    break;
+	case FIELD_DOUBLE:
+	    sqlite3_bind_double(stmt, i, *((double*)fieldPtr(it->second)) );
+	    nbytes += sizeof(double);
+	    break;
+	case FIELD_INT64:
+	    sqlite3_bind_int64(stmt, i, *((int64_t*)fieldPtr(it->second)) );
+	    nbytes += sizeof(int64_t);
+	    break;
+	case FIELD_FLOAT:
+	    sqlite3_bind_double(stmt, i, *((float*)fieldPtr(it->second)) );
+	    nbytes += sizeof(float);
+	    break;
+	case FIELD_INT16:
+	    sqlite3_bind_int(stmt, i, *((int16_t*)fieldPtr(it->second)) );
+	    nbytes += sizeof(int16_t);
+	    break;
+	case FIELD_BOOL:
+	    sqlite3_bind_int(stmt, i, *((bool*)fieldPtr(it->second)) );
+	    nbytes += sizeof(bool);
+	    break;
+	case FIELD_STRING:
+	    sqlite3_bind_text(stmt, i, 
+			      ((std::string*)fieldPtr(it->second))->c_str(), 
+			      ((std::string*)fieldPtr(it->second))->length(), 
+			      SQLITE_STATIC );
+	    nbytes += ((std::string*)fieldPtr(it->second))->length();
+	    break;
+	case FIELD_STRING_VIEW:
+	    sqlite3_bind_text(stmt, i, 
+			      ((std::string_view*)fieldPtr(it->second))->data(), 
+			      ((std::string_view*)fieldPtr(it->second))->length(), 
+			      SQLITE_STATIC );
+	    nbytes += ((std::string_view*)fieldPtr(it->second))->length();
+	    break;
+	case FIELD_BLOB: {
+	    size_t n = blobBytes( it->second );
+	    sqlite3_bind_blob(stmt, i, fieldPtr(it->second), n, SQLITE_STATIC );
+	    nbytes += n;
+	    break;
+	}
+	}
+	i++;
+    }
+
+    return nbytes;
+
+}
+
+
+/**
+ * Copy the current values of all mapped fields into row.
+ */
+void DatabaseRecord::snapshot( DatabaseRow &row ) {
+
+    std::map< std::string, DatabaseField >::iterator it;
+    int i=0;
+
+    row.resize( _fieldmap->size() );
+
+    for (it=_fieldmap->begin(); it != _fieldmap->end(); it++) {
+	switch (it->second.type) {
+	case FIELD_INT:
+	    row[i].ival = *((int*)fieldPtr(it->second));
+	    break;
+	case FIELD_DOUBLE:
+	    row[i].dval = *((double*)fieldPtr(it->second));
+	    break;
+	case FIELD_INT64:
+	    row[i].lval = *((int64_t*)fieldPtr(it->second));
+	    break;
+	case FIELD_FLOAT:
+	    row[i].dval = *((float*)fieldPtr(it->second));
+	    break;
+	case FIELD_INT16:
+	    row[i].ival = *((int16_t*)fieldPtr(it->second));
+	    break;
+	case FIELD_BOOL:
+	    row[i].ival = *((bool*)fieldPtr(it->second));
+	    break;
+	case FIELD_STRING:
+	    row[i].sval = *((std::string*)fieldPtr(it->second));
+	    break;
+	case FIELD_STRING_VIEW:
+	    row[i].sval = *((std::string_view*)fieldPtr(it->second));
+	    break;
+	case FIELD_BLOB:
+	    row[i].sval.assign( (const char*) fieldPtr(it->second), 
+				blobBytes(it->second) );
+	    break;
+	}
+	i++;
+    }
+
+}
+
+
+/**
+ * Bind a row previously filled by snapshot() to the parameters of
+ * stmt, starting with parameter number first. The strings are bound
+ * statically, so row must not change until stmt has been stepped.
+ *
+ * \returns the number of bytes bound
+ */
+size_t DatabaseRecord::bindRow( sqlite3_stmt *stmt, int first, 
+				const DatabaseRow &row ) {
+
+    std::map< std::string, DatabaseField >::iterator it;
+    int i=0;
+    size_t nbytes=0;
+
+    for (it=_fieldmap->begin(); it != _fieldmap->end(); it++) {
+	switch (it->second.type) {
+	case FIELD_INT:
+	    sqlite3_bind_int(stmt, first+i, row[i].ival );
+	    nbytes += sizeof(int);
+	    break;
+	case FIELD_DOUBLE:
+	    sqlite3_bind_double(stmt, first+i, row[i].dval );
+	    nbytes += sizeof(double);
+	    break;
+	case FIELD_INT64:
+	    sqlite3_bind_int64(stmt, first+i, row[i].lval );
+	    nbytes += sizeof(int64_t);
+	    break;
+	case FIELD_FLOAT:
+	    sqlite3_bind_double(stmt, first+i, row[i].dval );
+	    nbytes += sizeof(float);
+	    break;
+	case FIELD_INT16:
+	    sqlite3_bind_int(stmt, first+i, row[i].ival );
+	    nbytes += sizeof(int16_t);
+	    break;
+	case FIELD_BOOL:
+	    sqlite3_bind_int(stmt, first+i, row[i].ival );
+	    nbytes += sizeof(bool);
+	    break;
+	case FIELD_STRING:
+	case FIELD_STRING_VIEW:
+	    sqlite3_bind_text(stmt, first+i, row[i].sval.c_str(), 
+			      row[i].sval.length(), SQLITE_STATIC );
+	    nbytes += row[i].sval.length();
+	    break;
+	case FIELD_BLOB:
+	    sqlite3_bind_blob(stmt, first+i, row[i].sval.data(), 
+			      row[i].sval.length(), SQLITE_STATIC );
+	    nbytes += row[i].sval.length();
+	    break;
+	}
+	i++;
+    }
+
+    return nbytes;
+
+}
+
+
+/**
+ * Write rows in groups of nrows using a single multi-row INSERT
+ * statement, rather than stepping the INSERT once per row.  Rows
+ * given to writeToDatabase() are buffered inside the record and
+ * flushed whenever the buffer is full, and by finish().  The default
+ * of 1 disables batching. nrows is reduced if needed to stay below
+ * the maximum number of SQL parameters allowed by sqlite.
+ */
+void DatabaseRecord::setBatchSize( int nrows ) {
+
+    if (nrows < 1) nrows = 1;
+
+    if (_write_in_progress) {
+	stopWriter();
+	flushBatch();
+	if (_batchstmt) sqlite3_finalize( _batchstmt );
+	_batchstmt = NULL;
+    }
+
+    _batchsize = nrows;
+
+    if (_write_in_progress) {
+	prepareBatch();
+	startWriter();
+    }
+
+}
+
+
+/**
+ * Prepare the multi-row INSERT statement used when the batch size is
+ * greater than 1.  Called by prepareToWrite().
+ */
+void DatabaseRecord::prepareBatch() {
+
+    int maxrows;
+
+    _batchfill = 0;
+    if (_batchsize <= 1 || getNumFields() == 0) return;
+
+    maxrows = sqlite3_limit( _db, SQLITE_LIMIT_VARIABLE_NUMBER, -1 )
+	/ getNumFields();
+    if (_batchsize > maxrows) {
+	cout << "DatabaseRecord: batch size for '"<<_tablename
+	     << "' reduced to "<<maxrows<<" rows"<<endl;
+	_batchsize = maxrows;
+	if (_batchsize <= 1) return;
+    }
+
+    vector<string> tmp;
+    for (int i=0; i<getNumFields(); i++) {
+	tmp.push_back("?");
+    }
+    string values = "("+join(",",tmp)+")";
+
+    string sql = "INSERT INTO "+_tablename+" ("+getFieldList()+") VALUES ";
+    sql.reserve( sql.length() + _batchsize*(values.length()+1) );
+    for (int i=0; i<_batchsize; i++) {
+	if (i>0) sql.append(",");
+	sql.append( values );
+    }
+
+    if(sqlite3_prepare_v2( _db, sql.c_str(), sql.length(), &_batchstmt, NULL )
+       != SQLITE_OK) {
+	throw runtime_error("prepareBatch(): sql error on '"+_tablename+"': "
+			    +sqlite3_errmsg(_db));
+    }
+
+    _batch.resize( _batchsize );
+
+}
+
+
+/**
+ * Write out any rows buffered by writeToDatabase() in batch mode. A
+ * full buffer goes out as one multi-row INSERT, a partial one
+ * (e.g. at finish()) row by row through the normal INSERT statement.
+ * If the multi-row INSERT fails, none of its rows were inserted, so
+ * they are written again one at a time to find the bad ones. Rows
+ * that fail on their own are dropped, and once all the others are
+ * written, an error is thrown saying how many were dropped.
+ */
+void DatabaseRecord::flushBatch() {
+
+    size_t nbytes=0;
+    int nrows = _batchfill, ndropped = 0;
+    string err;
+
+    if (_batchfill == 0) return;
+    _batchfill = 0;	// every row is written or dropped below
+
+    ConnectionLock lock( _db );
+
+    if (nrows == _batchsize) {
+	stats_clock::time_point t0 = stats_clock::now();
+	for (int i=0; i<nrows; i++) {
+	    nbytes += bindRow( _batchstmt, i*getNumFields()+1, _batch[i] );
+	}
+	_bind_ns.add( elapsedNs(t0) );
+	try {
+	    stepInsert( _batchstmt );
+	    rowsWritten( nrows, nbytes );
+	    return;
+	}
+	catch (runtime_error &e) {
+	    nbytes = 0;
+	}
+    }
+
+    for (int i=0; i<nrows; i++) {
+	stats_clock::time_point t0 = stats_clock::now();
+	size_t n = bindRow( _wrstmt, 1, _batch[i] );
+	_bind_ns.add( elapsedNs(t0) );
+	try {
+	    stepInsert( _wrstmt );
+	    nbytes += n;
+	}
+	catch (runtime_error &e) {
+	    if (ndropped++ == 0) err = e.what();
+	}
+    }
+
+    rowsWritten( nrows-ndropped, nbytes );
+
+    if (ndropped > 0) {
+	ostringstream msg;
+	msg << err << " (" << ndropped << " of " << nrows 
+	    << " buffered rows dropped)";
+	throw runtime_error( msg.str() );
+    }
+
+}
+
+
+/**
+ * Make sure all rows given to writeToDatabase() so far are in the
+ * database (not in the batch buffer or the asynchronous write
+ * queue), so reads of this record's table see them. The transaction
+ * stays open.
+ */
+void DatabaseRecord::flushWrites() {
+
+    if (_write_in_progress == false) return;
+
+    stopWriter();
+    flushBatch();
+    startWriter();
+
+}
+
+
+/**
+ * By default, all rows written between the first writeToDatabase()
+ * and finish() go into a single transaction. This commits the
+ * transaction (and starts a new one) after every nrows rows, nbytes
+ * bytes of field data, or msec milliseconds, whichever comes
+ * first. Use 0 to disable any of the three. Committing more often
+ * bounds the size of the journal and the data lost if the program
+ * dies, at some cost in throughput. Note that the transaction
+ * belongs to the database connection, so a commit also covers rows
+ * written by other records using the same connection.
+ *
+ * With setAsyncWrite(), the commits are made by the writer thread.
+ * Other records may use the connection at the same time from other
+ * threads: each insert, and each COMMIT together with the BEGIN of
+ * the next transaction, holds the connection's mutex, so no insert
+ * falls between the two. This needs sqlite's serialized threading
+ * mode, as setAsyncWrite() does.
+ */
+void DatabaseRecord::setCommitPolicy( int nrows, size_t nbytes, int msec ) {
+
+    _commit_rows = nrows;
+    _commit_bytes = nbytes;
+    _commit_msec = msec;
+
+}
+
+
+/**
+ * Called whenever rows have been inserted into the table, to keep
+ * count and apply the commit policy.
+ */
+void DatabaseRecord::rowsWritten( int nrows, size_t nbytes ) {
+
+    _writecount += nrows;
+    _rows_written.add( nrows );
+    _bytes_bound.add( nbytes );
+
+    if (_commit_rows==0 && _commit_bytes==0 && _commit_msec==0) return;
+
+    _pending_rows += nrows;
+    _pending_bytes += nbytes;
+
+    if ((_commit_rows > 0 && _pending_rows >= _commit_rows)
+	|| (_commit_bytes > 0 && _pending_bytes >= _commit_bytes)
+	|| (_commit_msec > 0 
+	    && std::chrono::steady_clock::now() - _last_commit 
+	    >= std::chrono::milliseconds(_commit_msec))) {
+	commit();
+    }
+
+}
+
+
+/**
+ * Commit the current write transaction and open a new one. If another
+ * record on the connection has already ended it (see finish()), only
+ * the new one is opened.
+ */
+void DatabaseRecord::commit() {
+
+    ConnectionLock lock( _db );
+    if (sqlite3_get_autocommit( _db ) == 0) {
+	stats_clock::time_point t0 = stats_clock::now();
+	{
+	    BusyWatch watch( _retries, _busy_ns );
+	    if (sqlite3_exec( _db, "COMMIT", NULL, NULL, NULL ) != SQLITE_OK) {
+		// the transaction is still open, so this can be retried
+		throw runtime_error("commit on '"+_tablename+"': "
+				    +sqlite3_errmsg(_db));
+	    }
+	}
+	long long ns = elapsedNs(t0);
+	_commits.add(1);
+	_commit_ns.add( ns );
+	_max_commit_ns.max( ns );
+    }
+    beginTransaction();
+
+    _pending_rows = 0;
+    _pending_bytes = 0;
+    _last_commit = std::chrono::steady_clock::now();
+
+}
+
+
+/**
+ * Open the write transaction. It is opened IMMEDIATE, i.e. the write
+ * lock is taken right away (waiting for other writers, see
+ * setBusyTimeout()), so that later statements of the transaction
+ * can't fail because another connection got the lock in between.
+ * Only one transaction can be open per connection, so if another
+ * record on the same connection has opened one, its transaction is
+ * used.
+ */
+void DatabaseRecord::beginTransaction() {
+
+    ConnectionLock lock( _db );
+    if (sqlite3_get_autocommit( _db ) == 0) return;
+
+    BusyWatch watch( _retries, _busy_ns );
+    if (sqlite3_exec( _db, "BEGIN IMMEDIATE", NULL, NULL, NULL ) 
+	!= SQLITE_OK) {
+	throw runtime_error("begin transaction on '"+_tablename+"': "
+			    +sqlite3_errmsg(_db));
+    }
+
+}
+
+
+/**
+ * Execute an INSERT statement and reset it. Waiting for locks held by
+ * other connections is done by the busy handler (see
+ * setBusyTimeout()); SQLITE_LOCKED (a conflict within the same
+ * process, which sqlite doesn't wait for) is retried here, with the
+ * same backoff.  If the insert still fails, the statement is reset
+ * and the error is thrown. The transaction stays open, without the
+ * rows of the failed statement (see flushBatch() for batches).
+ */
+void DatabaseRecord::stepInsert( sqlite3_stmt *stmt ) {
+
+    ConnectionLock lock( _db );
+    BusyWatch watch( _retries, _busy_ns );
+    stats_clock::time_point t0 = stats_clock::now();
+    long long waited = 0;
+    int ret, attempt = 0;
+
+    while ((ret = sqlite3_step( stmt )) == SQLITE_LOCKED 
+	   && waited < LOCKED_TIMEOUT_NS) {
+	sqlite3_reset( stmt );
+	waited += backoff( attempt++ );
+    }
+
+    if (ret != SQLITE_DONE) {
+	string err = sqlite3_errmsg(_db);
+	sqlite3_reset( stmt );
+	throw runtime_error("write to '"+_tablename+"': "+err);
+    }
+    stats_clock::time_point t1 = stats_clock::now();
+    _step_ns.add( std::chrono::duration_cast<std::chrono::nanoseconds>
+		  (t1-t0).count() );
+    sqlite3_reset( stmt );
+    _reset_ns.add( elapsedNs(t1) );
+
+}
+
+
+/**
+ * Hand rows over to a separate writer thread, so writeToDatabase()
+ * never waits for sqlite. writeToDatabase() copies the mapped values
+ * into one of nslots preallocated slots of a lock-free queue and
+ * returns immediately; the writer thread takes the rows from the
+ * queue and inserts them (in batches, if setBatchSize() was
+ * used). When the queue is full, writeToDatabase() waits for the
+ * writer to catch up. finish() waits until the queue is empty and the
+ * transaction has been committed.  nslots=0 (the default) turns
+ * asynchronous writing off.
+ *
+ * Since the writer thread shares the database connection, the
+ * connection must be in sqlite's serialized threading mode (the
+ * default). Other records may keep writing through the connection
+ * from the main thread; see setCommitPolicy() for how the
+ * transaction is shared with them.
+ */
+void DatabaseRecord::setAsyncWrite( int nslots ) {
+
+    if (nslots < 0) nslots = 0;
+    if (nslots > 0 && sqlite3_threadsafe() == 0)
+	throw runtime_error("setAsyncWrite(): sqlite is not thread-safe");
+
+    if (_write_in_progress) stopWriter();
+    _asyncslots = nslots;
+    if (_write_in_progress) startWriter();
+
+}
+
+
+/**
+ * Start the writer thread for asynchronous writes, if enabled
+ */
+void DatabaseRecord::startWriter() {
+
+    if (_asyncslots == 0 || _queue) return;
+    if (sqlite3_db_mutex( _db ) == NULL)
+	throw runtime_error("setAsyncWrite(): the connection to '"+_tablename
+			    +"' is not in serialized threading mode");
+
+    _queue = new RowQueue( _asyncslots, getNumFields() );
+    _writer = new std::thread( &DatabaseRecord::drainQueue, this );
+
+}
+
+
+/**
+ * Write out all queued rows and stop the writer thread. If the writer
+ * failed, the rows queued after the failing one are lost, and the
+ * error is thrown once the thread and queue are gone.
+ */
+void DatabaseRecord::stopWriter() {
+
+    if (_queue == NULL) return;
+
+    _queue->close();
+    _writer->join();
+
+    bool failed = _queue->failed();
+    string err = _queue->error();
+
+    delete _writer;
+    delete _queue;
+    _writer = NULL;
+    _queue = NULL;
+
+    if (failed) 
+	throw runtime_error("asynchronous write to '"+_tablename+"' failed: "
+			    +err);
+
+}
+
+
+/**
+ * Main loop of the writer thread: write queued rows until the queue
+ * is closed and empty.
+ */
+void DatabaseRecord::drainQueue() {
+
+    DatabaseRow *row;
+    int idle=0;
+
+    try {
+	for (;;) {
+	    if ((row = _queue->front()) != NULL) {
+		writeRow( *row );
+		_queue->pop();
+		idle = 0;
+	    }
+	    else if (_queue->closed()) {
+		if (_queue->front() == NULL) break;
+	    }
+	    else if (++idle < 64) {
+		std::this_thread::yield();
+	    }
+	    else {
+		std::this_thread::sleep_for( std::chrono::microseconds(50) );
+	    }
+	}
+    }
+    catch (runtime_error &e) {
+	_queue->fail( e.what() );
+    }
+
+}
+
+
+/**
+ * Read rows ahead in a separate thread, so that sqlite steps and
+ * decodes the next rows while the caller works on the current
+ * one. After prepareToRead(), the reader thread fills up to nslots
+ * preallocated row slots of a lock-free queue, and readFromDatabase()
+ * only copies the next one into the mapped variables (waiting if the
+ * reader is behind). Worth it when there is real work per row and a
+ * spare core; otherwise it only adds the copy. finish() (or the next
+ * prepareToRead()) stops the reader.  nslots=0 (the default) turns
+ * prefetching off. Takes effect at the next prepareToRead(); a read
+ * in progress is ended.
+ *
+ * As with setAsyncWrite(), sqlite must have been compiled
+ * thread-safe. std::string_view fields stay valid until the next
+ * readFromDatabase(), as without prefetching.
+ */
+void DatabaseRecord::setPrefetch( int nslots ) {
+
+    if (nslots < 0) nslots = 0;
+    if (nslots > 0 && sqlite3_threadsafe() == 0)
+	throw runtime_error("setPrefetch(): sqlite is not thread-safe");
+
+    if (_read_in_progress) endRead();
+    _prefetchslots = nslots;
+
+}
+
+
+/**
+ * Start the reader thread for prefetching, if enabled. The fields
+ * read are fixed here, so the reader thread never looks at the field
+ * map.
+ */
+void DatabaseRecord::startReader() {
+
+    if (_prefetchslots == 0 || _rdqueue) return;
+
+    _rdfields.clear();
+    if (_projection.empty() && _rowid_col < 0) {
+	std::map< std::string, DatabaseField >::iterator it;
+	for (it=_fieldmap->begin(); it != _fieldmap->end(); it++) 
+	    _rdfields.push_back( &it->second );
+    }
+    else _rdfields = _projection;
+
+    // one more value for the rowid, if selected
+    _rdqueue = new RowQueue( _prefetchslots, 
+			     _rdfields.size() + (_rowid_col >= 0) );
+    _rdrow = NULL;
+    _reader = new std::thread( &DatabaseRecord::fillQueue, this );
+
+}
+
+
+/**
+ * Stop the reader thread (which may not have read all rows)
+ */
+void DatabaseRecord::stopReader() {
+
+    if (_rdqueue == NULL) return;
+
+    if (!_rdqueue->closed()) _rdqueue->fail( "stopped" );
+    _reader->join();
+
+    delete _reader;
+    delete _rdqueue;
+    _reader = NULL;
+    _rdqueue = NULL;
+    _rdrow = NULL;
+
+}
+
+
+/**
+ * End the read in progress, stopping the reader thread first if there
+ * is one
+ */
+void DatabaseRecord::endRead() {
+
+    stopReader();
+    closeBlobs();
+    _cache.release( _rdsql, _rdstmt );
+    _rdstmt = NULL;
+    _read_in_progress = false;
+
+}
+
+
+/**
+ * Main loop of the reader thread: step the read statement and copy
+ * each row into the queue, until there are no more rows or the
+ * reading side gives up.
+ */
+void DatabaseRecord::fillQueue() {
+
+    DatabaseRow *row;
+    const char *text;
+    int idle=0;
+
+    for (;;) {
+	if ((row = _rdqueue->back()) == NULL) {
+	    if (_rdqueue->failed()) return;
+	    if (++idle < 64) std::this_thread::yield();
+	    else std::this_thread::sleep_for( std::chrono::microseconds(50) );
+	    continue;
+	}
+	idle = 0;
+
+	int ret = sqlite3_step( _rdstmt );
+	if (ret == SQLITE_DONE) {
+	    _rdqueue->close();
+	    return;
+	}
+	if (ret != SQLITE_ROW) {
+	    _rdqueue->fail( sqlite3_errmsg(_db) );
+	    return;
+	}
+
+	for (size_t i=0; i<_rdfields.size(); i++) {
+	    switch (_rdfields[i]->type) {
+	    case FIELD_INT:
+	    case FIELD_INT16:
+	    case FIELD_BOOL:
+		(*row)[i].ival = sqlite3_column_int( _rdstmt, i );
+		break;
+	    case FIELD_DOUBLE:
+	    case FIELD_FLOAT:
+		(*row)[i].dval = sqlite3_column_double( _rdstmt, i );
+		break;
+	    case FIELD_INT64:
+		(*row)[i].lval = sqlite3_column_int64( _rdstmt, i );
+		break;
+	    case FIELD_STRING:
+	    case FIELD_STRING_VIEW:
+		text = (const char*) sqlite3_column_text( _rdstmt, i );
+		if (text) 
+		    (*row)[i].sval.assign( text, 
+					   sqlite3_column_bytes( _rdstmt, i ) );
+		else 
+		    (*row)[i].sval.clear();
+		break;
+	    case FIELD_BLOB:
+		text = (const char*) sqlite3_column_blob( _rdstmt, i );
+		(*row)[i].sval.assign( text ? text : "",
+				       sqlite3_column_bytes( _rdstmt, i ) );
+		break;
+	    }
+	}
+	if (_rowid_col >= 0) 
+	    (*row)[_rowid_col].lval = sqlite3_column_int64( _rdstmt, _rowid_col );
+	_rdqueue->push();
+    }
+
+}
+
+
+/**
+ * readFromDatabase() with prefetching: give the previous slot back to
+ * the reader and copy the next one into the mapped variables.
+ * Strings are swapped rather than copied (the slot gets the old
+ * string's buffer to reuse).
+ */
+int DatabaseRecord::readPrefetched() {
+
+    int idle=0;
+
+    if (_rdrow) {
+	_rdqueue->pop();
+	_rdrow = NULL;
+    }
+
+    while ((_rdrow = _rdqueue->front()) == NULL) {
+	if (_rdqueue->failed())
+	    throw runtime_error(string("readFromDatabase() step: ")
+				+_rdqueue->error());
+	if (_rdqueue->closed()) {
+	    if ((_rdrow = _rdqueue->front()) != NULL) break;
+	    return 0;
+	}
+	if (++idle < 64) std::this_thread::yield();
+	else std::this_thread::sleep_for( std::chrono::microseconds(50) );
+    }
+
+    DatabaseRow &row = *_rdrow;
+    for (size_t i=0; i<_rdfields.size(); i++) {
+	switch (_rdfields[i]->type) {
+	case FIELD_INT:
+	    *((int*)fieldPtr(*_rdfields[i])) = row[i].ival;
+	    break;
+	case FIELD_DOUBLE:
+	    *((double*)fieldPtr(*_rdfields[i])) = row[i].dval;
+	    break;
+	case FIELD_INT64:
+	    *((int64_t*)fieldPtr(*_rdfields[i])) = row[i].lval;
+	    break;
+	case FIELD_FLOAT:
+	    *((float*)fieldPtr(*_rdfields[i])) = row[i].dval;
+	    break;
+	case FIELD_INT16:
+	    *((int16_t*)fieldPtr(*_rdfields[i])) = row[i].ival;
+	    break;
+	case FIELD_BOOL:
+	    *((bool*)fieldPtr(*_rdfields[i])) = row[i].ival;
+	    break;
+	case FIELD_STRING:
+	    ((std::string*)fieldPtr(*_rdfields[i]))->swap( row[i].sval );
+	    break;
+	case FIELD_STRING_VIEW:
+	    if (_arena)
+		*((std::string_view*)fieldPtr(*_rdfields[i])) 
+		    = _arena->store( row[i].sval.data(), row[i].sval.length() );
+	    else
+		*((std::string_view*)fieldPtr(*_rdfields[i])) = row[i].sval;
+	    break;
+	case FIELD_BLOB:
+	    fetchBlob( *_rdfields[i], row[i].sval.data(), row[i].sval.length(),
+		       *this );
+	    break;
+	}
+    }
+    if (_rowid_col >= 0) _rdrowid = row[_rowid_col].lval;
+
+    _rows_read.add(1);
+    return 1;
+
+}
+
+
+/**
+ * Write one row taken from the asynchronous write queue
+ */
+void DatabaseRecord::writeRow( DatabaseRow &row ) {
+
+    if (_batchstmt != NULL) {
+	_batch[_batchfill].swap( row );
+	_batchfill++;
+	if (_batchfill == _batchsize) flushBatch();
+	return;
+    }
+
+    stats_clock::time_point t0 = stats_clock::now();
+    size_t nbytes = bindRow( _wrstmt, 1, row );
+    _bind_ns.add( elapsedNs(t0) );
+    ConnectionLock lock( _db );
+    stepInsert( _wrstmt );
+    rowsWritten( 1, nbytes );
+
+}
+
+
+/**
+ * \returns the SQL column type used for a field
+ */
+static const char *columnType( const DatabaseField &field ) {
+
+    switch (field.type) {
+    case FIELD_INT:
+    case FIELD_INT64:
+	return "INTEGER";
+    case FIELD_INT16:
+	return "SMALLINT";
+    case FIELD_BOOL:
+	return "BOOLEAN";
+    case FIELD_DOUBLE:
+	return "DOUBLE";
+    case FIELD_FLOAT:
+	return "FLOAT";
+    case FIELD_STRING:
+    case FIELD_STRING_VIEW:
+	return "TEXT";
+    case FIELD_BLOB:
+	return "BLOB";
+    }
+    return "";
+
+}
+
+
+/**
+ * Returns an SQL schema string for the table
+ */
+string DatabaseRecord::getSchema() {
+
+    vector<string> fields;
+    string tmp;
+    std::map< std::string, DatabaseField >::iterator it;
+
+    for (it=_fieldmap->begin(); it != _fieldmap->end(); it++) {
+	if (it->second.primary_key==true) 
+	    tmp ="PRIMARY KEY";
+	else tmp = "";
+
+	fields.push_back( it->first + " " + columnType(it->second) + " " + tmp );
+    }
+
+    return join( ", ",fields ); 
+
+}
+
+/**
+ * \returns a list of all mapped fields, separated by commas
+ */
+string DatabaseRecord::getFieldList() {
+    vector<string> fields;
+    std::map< std::string, DatabaseField >::iterator it;
+    for (it=_fieldmap->begin(); it != _fieldmap->end(); it++) {
+	fields.push_back(it->first);
+    }
+
+    return join(", ",fields );
+}
+
+/**
+ * \returns a list of all mapped fields, each prefixed with the table
+ * name (for queries on several tables)
+ */
+string DatabaseRecord::getQualifiedFieldList() {
+    vector<string> fields;
+    std::map< std::string, DatabaseField >::iterator it;
+    for (it=_fieldmap->begin(); it != _fieldmap->end(); it++) {
+	fields.push_back(_tablename+"."+it->first);
+    }
+
+    return join(", ",fields );
+}
+
+/**
+ * \returns the given field names separated by commas
+ */
+string DatabaseRecord::getFieldList( const std::vector<std::string> &fields ) {
+    vector<string> tmp( fields );
+    return join(", ",tmp );
+}
+
+
+
+/**
+ * \returns the SELECT statement for reading the (projected) fields of
+ * the rows matching where_clause
+ */
+string DatabaseRecord::readSQL( const std::string &where_clause ) {
+
+    string sql;
+
+    if (_projection.empty() && _rowid_col < 0)
+	sql = "SELECT "+getFieldList()+" FROM "+_tablename;
+    else if (_rowid_col < 0)
+	sql = "SELECT "+getFieldList(_projection_names)+" FROM "+_tablename;
+    else if (_projection.empty())
+	sql = "SELECT rowid FROM "+_tablename;
+    else
+	sql = "SELECT "+getFieldList(_projection_names)+", rowid FROM "
+	    +_tablename;
+    if (where_clause != "") {
+	sql.append(" WHERE "+where_clause );
+    }
+    return sql;
+
+}
+
+
+/**
+ * prepare to read from the database. This should be called before
+ * calling readFromDatabase(). You can specify an optional "WHERE"
+ * clause to limit the results.
+ */
+void 
+DatabaseRecord::prepareToRead( std::string where_clause ) {
+    prepareToRead( where_clause, QueryParams() );
+}
+
+
+/**
+ * Like prepareToRead(where_clause), but the where clause may contain
+ * '?' placeholders, which are replaced by the values in params, e.g.
+ *
+ *	rec.prepareToRead( "x<? AND i>?", {0.5, 10} );
+ *
+ * Since the SQL text stays the same for different values, the
+ * statement is prepared only once and kept in a cache for the next
+ * call.
+ */
+void 
+DatabaseRecord::prepareToRead( std::string where_clause, 
+			       const QueryParams &params ) {
+
+    string sql;
+
+    if (_db == NULL) throw runtime_error("NO DATABASE CONNECTION!");
+
+    flushWrites();
+
+    if (_read_in_progress) endRead();
+
+    sql = readSQL( where_clause );
+    _rdstmt = _cache.acquire( _db, sql );
+    if (_rdstmt == NULL) {
+	throw runtime_error("prepareToRead(): couldn't prepare '"+sql+
+			    "': "+sqlite3_errmsg(_db) );
+    }
+    _rdsql = sql;
+    _read_in_progress=true;
+
+    bindParams( _rdstmt, params );
+    startReader();
+
+}
+
+
+/**
+ * Read the given fields of all rows matching where_clause at once,
+ * into one contiguous vector per field (rather than one struct per
+ * row, as readFromDatabase() does). The mapped variables of the
+ * record are not changed, and a read started with prepareToRead() is
+ * not affected. Example:
+ *
+ *	DatabaseColumns cols = p.readColumns( {"size","width"}, "size>100" );
+ *	const vector<double> &size = cols.get<double>("size");
+ */
+DatabaseColumns
+DatabaseRecord::readColumns( const std::vector<std::string> &fields,
+			     std::string where_clause,
+			     const QueryParams &params ) {
+
+    DatabaseColumns cols;
+    vector<DatabaseColumn*> colptr;
+    sqlite3_stmt *stmt;
+    string sql;
+    int ret;
+    size_t n;
+
+    if (_db == NULL) throw runtime_error("NO DATABASE CONNECTION!");
+    if (fields.empty()) throw runtime_error("readColumns(): no fields given");
+
+    for (size_t i=0; i<fields.size(); i++) {
+	std::map< std::string, DatabaseField >::iterator it;
+	it = _fieldmap->find( fields[i] );
+	if (it == _fieldmap->end()) 
+	    throw runtime_error("readColumns(): no field '"+fields[i]+
+				"' in '"+_tablename+"'");
+	if (it->second.type == FIELD_BLOB)
+	    throw runtime_error("readColumns(): '"+fields[i]+
+				"' is an array field");
+	switch (it->second.type) {
+	case FIELD_STRING_VIEW:
+	    cols._columns[fields[i]].type = FIELD_STRING;
+	    break;
+	case FIELD_INT16:
+	case FIELD_BOOL:
+	    cols._columns[fields[i]].type = FIELD_INT;
+	    break;
+	default:
+	    cols._columns[fields[i]].type = it->second.type;
+	}
+	colptr.push_back( &cols._columns[fields[i]] );
+    }
+
+    n = count( where_clause, params );
+    for (size_t i=0; i<colptr.size(); i++) {
+	switch (colptr[i]->type) {
+	case FIELD_INT:
+	    colptr[i]->ints.reserve(n);
+	    break;
+	case FIELD_DOUBLE:
+	    colptr[i]->doubles.reserve(n);
+	    break;
+	case FIELD_INT64:
+	    colptr[i]->int64s.reserve(n);
+	    break;
+	case FIELD_FLOAT:
+	    colptr[i]->floats.reserve(n);
+	    break;
+	case FIELD_STRING:
+	case FIELD_STRING_VIEW:
+	    colptr[i]->strings.reserve(n);
+	    break;
+	case FIELD_INT16:	// read as FIELD_INT
+	case FIELD_BOOL:
+	case FIELD_BLOB:	// rejected above
+	    break;
+	}
+    }
+
+    sql = "SELECT "+getFieldList(fields)+" FROM "+_tablename;
+    if (where_clause != "") {
+	sql.append(" WHERE "+where_clause );
+    }
+
+    stmt = _cache.acquire( _db, sql );
+    if (stmt == NULL) {
+	throw runtime_error("readColumns(): couldn't prepare '"+sql+
+			    "': "+sqlite3_errmsg(_db) );
+    }
+    try {
+	bindParams( stmt, params );
+    }
+    catch (runtime_error &e) {
+	_cache.release( sql, stmt );
+	throw;
+    }
+
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+	for (size_t i=0; i<colptr.size(); i++) {
+	    const char *text;
+	    switch (colptr[i]->type) {
+	    case FIELD_INT:
+		colptr[i]->ints.push_back( sqlite3_column_int(stmt,i) );
+		break;
+	    case FIELD_DOUBLE:
+		colptr[i]->doubles.push_back( sqlite3_column_double(stmt,i) );
+		break;
+	    case FIELD_INT64:
+		colptr[i]->int64s.push_back( sqlite3_column_int64(stmt,i) );
+		break;
+	    case FIELD_FLOAT:
+		colptr[i]->floats.push_back( sqlite3_column_double(stmt,i) );
+		break;
+	    case FIELD_STRING:
+	    case FIELD_STRING_VIEW:
+		text = (const char*) sqlite3_column_text(stmt,i);
+		colptr[i]->strings.push_back( text ? text : "" );
+		break;
+	    case FIELD_INT16:
+	    case FIELD_BOOL:
+	    case FIELD_BLOB:
+		break;
+	    }
+	}
+	cols._nrows++;
+    }
+
+    if (ret != SQLITE_DONE) {
+	string err = sqlite3_errmsg(_db);
+	_cache.release( sql, stmt );
+	throw runtime_error("readColumns() step: "+err);
+    }
+    _cache.release( sql, stmt );
+
+    return cols;
+
+}
+
+
+/**
+ * Returns the column of the given name, checking that it has the
+ * expected type.
+ */
+const DatabaseColumn &
+DatabaseColumns::column( const std::string &name, 
+			 DatabaseFieldType type ) const {
+
+    std::map< std::string, DatabaseColumn >::const_iterator it;
+
+    it = _columns.find( name );
+    if (it == _columns.end())
+	throw runtime_error("DatabaseColumns: no column '"+name+"'");
+    if (it->second.type != type)
+	throw runtime_error("DatabaseColumns: wrong type requested for '"
+			    +name+"'");
+    return it->second;
+
+}
+
+
+/**
+ * Automatically called the first time writeToDatabase() is called
+ */
+void 
+DatabaseRecord::prepareToWrite() {
+    
+    checkSchemaVersion();
+
+    if (tableExists() == false) {
+	cout << "DatabaseRecord: Table '"
+	     <<_tablename<<"' doesn't exist, creating it..."<<endl;
+	createTable();
+    }
+    else addMissingColumns( true );
+
+    string sql = "INSERT INTO "+_tablename+" ("+getFieldList()+") VALUES (";
+
+    vector<string> tmp;
+    for (int i=0; i<getNumFields(); i++) {
+	tmp.push_back("?");
+    }
+
+    sql.append( join(",",tmp) );
+    sql.append(")");
+
+    if(sqlite3_prepare_v2( _db, sql.c_str(), sql.length(), &_wrstmt, NULL ) 
+       != SQLITE_OK) {
+	throw runtime_error("prepareToWrite(): sql error with '"+sql+"': "
+			    +sqlite3_errmsg(_db));
+    }
+
+    try {
+	beginTransaction();
+	// rebuilding the indexes in finish() only pays off if they
+	// would cover nothing but the new rows. They are dropped inside
+	// the transaction, so a crash before the first commit leaves
+	// them in place.
+	_indexes_dropped = false;
+	if (_defer_indexes && tableEmpty()) {
+	    dropIndexes();
+	    _indexes_dropped = true;
+	}
+    }
+    catch (runtime_error &e) {
+	sqlite3_finalize( _wrstmt );
+	_wrstmt = NULL;
+	throw;
+    }
+    _pending_rows = 0;
+    _pending_bytes = 0;
+    _last_commit = std::chrono::steady_clock::now();
+
+    prepareBatch();
+    startWriter();
+
+    _write_in_progress= true;
+
+}
+
+
+/**
+ * End all database transactions.  This is called automatically when a
+ * DatabaseRecord is deleted, but can be called manually if needed to
+ * finish up the output.  If writing failed (asynchronously, in the
+ * last batch, or when building the deferred indexes), the cleanup is
+ * still done and the rows written are committed, and then the first
+ * error is thrown. Indexes that couldn't be built are tried again by
+ * the next setDatabaseHandle().
+ */
+void
+DatabaseRecord::finish() {
+
+    string error;
+
+    if (_write_in_progress &&  _db) {
+	try {
+	    stopWriter();
+	}
+	catch (runtime_error &e) {
+	    error = e.what();
+	}
+	try {
+	    flushBatch();
+	}
+	catch (runtime_error &e) {
+	    if (error == "") error = e.what();
+	}
+	if (_batchstmt) {
+	    sqlite3_finalize( _batchstmt );
+	    _batchstmt = NULL;
+	}
+	if (_indexes_dropped) {
+	    // in the last transaction, so they are committed with it
+	    try {
+		createIndexes( true );
+	    }
+	    catch (runtime_error &e) {
+		if (error == "") error = e.what();
+	    }
+	    _indexes_dropped = false;
+	}
+	ConnectionLock lock( _db );
+	stats_clock::time_point t0 = stats_clock::now();
+	BusyWatch watch( _retries, _busy_ns );
+	if (sqlite3_get_autocommit( _db ) == 0
+	    && sqlite3_exec( _db, "END TRANSACTION", NULL, NULL, NULL ) 
+	    == SQLITE_OK) {
+	    long long ns = elapsedNs(t0);
+	    _commits.add(1);
+	    _commit_ns.add( ns );
+	    _max_commit_ns.max( ns );
+	}
+	if (sqlite3_finalize( _wrstmt )) 
+	    cout <<"ERROR: couldn't finalize "<<_tablename<<": "
+		 <<sqlite3_errmsg(_db)<<endl;
+	_wrstmt = NULL;
+	_write_in_progress= false;
+    }
+    if (_read_in_progress && _db) endRead();
+    _cache.clear();
+
+    if (error != "") throw runtime_error( error );
+    
+}
+
+
+/**
+ * You must have called prepareToRead() before calling this.
+ * Thereafter, each time readFromDatabase is called, the mapped values
+ * of your subclass will be updated with the next row of the database. 
+ *
+ * std::string_view fields point directly at the row data held by
+ * sqlite, so they are only valid until the next call (unless
+ * useStringArena() is on).
+ *
+ * \returns 0 if no more rows are available, 1 if a row was read successfully.
+ */
+int
+DatabaseRecord:: 
+readFromDatabase() {
+
+    int ret;
+
+    if (_db == NULL) throw runtime_error("NO DATABASE CONNECTION!");
+
+    if (_rdqueue) return readPrefetched();
+
+    ret = sqlite3_step(_rdstmt) ;
+    if (ret == SQLITE_ROW) {
+	fetchRow( *this, _rdstmt );
+	_rows_read.add(1);
+	return 1;
+    }
+    else if (ret==SQLITE_DONE) {
+	return 0;
+    }
+    else{
+	throw runtime_error(string("readFromDatabase() step: ")
+			    +sqlite3_errmsg(_db));
+	return 0;
+    }
+
+}
+
+
+/**
+ * Copy column i of the current row of stmt into the variable mapped
+ * by field in dest
+ */
+inline void
+DatabaseRecord::fetchField( sqlite3_stmt *stmt, int i, 
+			    const DatabaseField &field, DatabaseRecord &dest ) {
+
+    const char *text;
+    const void *blob;
+    void *ptr = dest.fieldPtr( field );
+
+    switch (field.type) {
+    case FIELD_INT:
+	*((int*)ptr) = sqlite3_column_int(stmt,i);
+	break;
+    case FIELD_DOUBLE:
+	*((double*)ptr) = sqlite3_column_double(stmt,i);
+	break;
+    case FIELD_INT64:
+	*((int64_t*)ptr) = sqlite3_column_int64(stmt,i);
+	break;
+    case FIELD_FLOAT:
+	*((float*)ptr) = sqlite3_column_double(stmt,i);
+	break;
+    case FIELD_INT16:
+	*((int16_t*)ptr) = sqlite3_column_int(stmt,i);
+	break;
+    case FIELD_BOOL:
+	*((bool*)ptr) = sqlite3_column_int(stmt,i);
+	break;
+    case FIELD_STRING:
+	text = (const char*) sqlite3_column_text(stmt,i);
+	if (text) 
+	    ((std::string*)ptr)
+		->assign( text, sqlite3_column_bytes(stmt,i) );
+	else
+	    ((std::string*)ptr)->clear();
+	break;
+    case FIELD_STRING_VIEW:
+	text = (const char*) sqlite3_column_text(stmt,i);
+	if (text && _arena)
+	    *((std::string_view*)ptr) 
+		= _arena->store( text, sqlite3_column_bytes(stmt,i) );
+	else if (text)
+	    *((std::string_view*)ptr) 
+		= std::string_view( text, sqlite3_column_bytes(stmt,i) );
+	else
+	    *((std::string_view*)ptr) = std::string_view();
+	break;
+    case FIELD_BLOB:
+	blob = sqlite3_column_blob(stmt,i);
+	fetchBlob( field, blob, sqlite3_column_bytes(stmt,i), dest );
+	break;
+    }
+
+}
+
+
+/**
+ * Copy the values of the current row of stmt into the mapped
+ * variables. The record's fields are expected in columns first,
+ * first+1, ... in field map order (as given by getFieldList()).
+ */
+void
+DatabaseRecord::fetchFields( sqlite3_stmt *stmt, int first ) {
+    fetchInto( *this, stmt, first );
+}
+
+
+/**
+ * Like fetchFields(), but into the variables of dest, which must be a
+ * record of the same class (e.g. a copy of this one)
+ */
+void
+DatabaseRecord::fetchInto( DatabaseRecord &dest, sqlite3_stmt *stmt, 
+			   int first ) {
+
+    std::map< std::string, DatabaseField >::iterator it;
+    int i=first;
+
+    if (_codec && _use_codec && _arena == NULL) {
+	_codec->fetch( dest, stmt, first );
+	return;
+    }
+
+    for (it=_fieldmap->begin(); it != _fieldmap->end(); it++) {
+	fetchField( stmt, i, it->second, dest );
+	i++;
+    }
+
+}
+
+
+/**
+ * Copy the current row of the read statement stmt (prepared by
+ * readSQL()) into dest, respecting the projection
+ */
+void
+DatabaseRecord::fetchRow( DatabaseRecord &dest, sqlite3_stmt *stmt ) {
+
+    if (_projection.empty() && _rowid_col < 0) {
+	fetchInto( dest, stmt, 0 );
+	return;
+    }
+    for (size_t i=0; i<_projection.size(); i++)
+	fetchField( stmt, i, *_projection[i], dest );
+    if (_rowid_col >= 0) 
+	dest._rdrowid = sqlite3_column_int64( stmt, _rowid_col );
+
+}
+
+
+/**
+ * The tables and columns of each open database, so that checking a
+ * record's table against its fields doesn't need a query per table.
+ * A connection's entry is loaded (in one query) on first use, and
+ * reloaded by checkSchemaVersion() if the schema_version of its file
+ * has changed since, i.e. after any CREATE, ALTER or DROP by another
+ * connection. This connection's own CREATE and ALTER mark it stale.
+ * The entry is dropped when the connection is closed (see
+ * connectionClosed()).
+ */
+struct SchemaCatalog {
+    struct Entry {
+	Entry() : loaded(false), version(-1) {;}
+	bool loaded;
+	sqlite3_int64 version;
+	std::map< std::string, std::set<std::string> > tables;
+    };
+    std::mutex lock;
+    std::map< database_t, Entry > dbs;
+};
+
+static SchemaCatalog &schemaCatalog() {
+    static SchemaCatalog catalog;
+    return catalog;
+}
+
+
+/**
+ * SQL names are case-insensitive, so they are looked up in lower case
+ */
+static string lowercase( string name ) {
+    for (size_t i=0; i<name.length(); i++) name[i] = tolower(name[i]);
+    return name;
+}
+
+
+/**
+ * Load the catalog entry of a connection, if it isn't loaded yet or
+ * (with check_version) the schema has changed. The catalog must be
+ * locked.
+ */
+static SchemaCatalog::Entry &catalogEntry( database_t db, 
+					   bool check_version ) {
+
+    sqlite3_stmt *stmt;
+    sqlite3_int64 version = -1;
+    SchemaCatalog::Entry &entry = schemaCatalog().dbs[db];
+
+    if (entry.loaded && check_version == false) return entry;
+
+    if (sqlite3_prepare_v2( db, "PRAGMA schema_version", -1, &stmt, NULL )
+	!= SQLITE_OK) {
+	throw runtime_error("catalogEntry(): "+string(sqlite3_errmsg(db)));
+    }
+    if (sqlite3_step( stmt ) == SQLITE_ROW) 
+	version = sqlite3_column_int64( stmt, 0 );
+    sqlite3_finalize( stmt );
+
+    if (entry.loaded && entry.version == version) return entry;
+
+    const char *sql = 
+	"SELECT m.name, c.name FROM sqlite_master AS m, "
+	"pragma_table_info(m.name) AS c WHERE m.type='table'";
+    if (sqlite3_prepare_v2( db, sql, -1, &stmt, NULL ) != SQLITE_OK) {
+	throw runtime_error("catalogEntry(): "+string(sqlite3_errmsg(db)));
+    }
+    entry.tables.clear();
+    while (sqlite3_step( stmt ) == SQLITE_ROW) {
+	string tab = (const char*) sqlite3_column_text( stmt, 0 );
+	string col = (const char*) sqlite3_column_text( stmt, 1 );
+	entry.tables[ lowercase(tab) ].insert( lowercase(col) );
+    }
+    sqlite3_finalize( stmt );
+    entry.version = version;
+    entry.loaded = true;
+    return entry;
+
+}
+
+
+/**
+ * Get the (lower case) column names of a table from the catalog.
+ *
+ * \returns false if the table doesn't exist
+ */
+static bool catalogColumns( database_t db, const std::string &table,
+			    std::set<std::string> &columns,
+			    bool check_version=false ) {
+
+    SchemaCatalog &cat = schemaCatalog();
+    std::lock_guard<std::mutex> guard( cat.lock );
+    SchemaCatalog::Entry &entry = catalogEntry( db, check_version );
+
+    std::map< std::string, std::set<std::string> >::iterator it;
+    it = entry.tables.find( lowercase(table) );
+    if (it == entry.tables.end()) return false;
+    columns = it->second;
+    return true;
+
+}
+
+
+/**
+ * Mark the catalog of a connection for reloading, after it changed
+ * the schema itself
+ */
+static void catalogChanged( database_t db ) {
+
+    SchemaCatalog &cat = schemaCatalog();
+    std::lock_guard<std::mutex> guard( cat.lock );
+    cat.dbs[db].loaded = false;
+
+}
+
+
+/**
+ * Reload the catalog of this record's connection if another
+ * connection has changed the schema. Done once when the record is
+ * connected and at the start of each write session, rather than on
+ * every tableExists().
+ */
+void DatabaseRecord::checkSchemaVersion() {
+
+    if (_db == NULL) throw runtime_error("NO DATABASE CONNECTION!");
+
+    SchemaCatalog &cat = schemaCatalog();
+    std::lock_guard<std::mutex> guard( cat.lock );
+    catalogEntry( _db, true );
+
+}
+
+
+/**
+ * Drop the catalog of a connection (when it is closed, so a new
+ * connection that gets the same handle doesn't inherit it)
+ */
+static void forgetCatalog( database_t db ) {
+
+    SchemaCatalog &cat = schemaCatalog();
+    std::lock_guard<std::mutex> guard( cat.lock );
+    cat.dbs.erase( db );
+
+}
+
+void Database::forgetCatalog() {
+    ::forgetCatalog( _db );
+}
+
+
+/**
+ * Create the table in the database. If it already exists (e.g. it was
+ * just created through another connection), the existing table is
+ * kept and only given the columns it lacks.
+ */
+void DatabaseRecord::createTable() {
+    
+    string sql;
+
+    if (_tablename == "")
+	throw runtime_error("createTable: No table name specified");
+
+    sql = "CREATE TABLE IF NOT EXISTS "+_tablename+" ("+ getSchema() +")";
+    
+    int ret;
+
+    ret = sqlite3_exec( _db, sql.c_str(), NULL, NULL, NULL );
+    catalogChanged( _db );
+
+    if (ret != SQLITE_OK) {
+	throw runtime_error("createTable(): "+sql+": "+sqlite3_errmsg(_db));
+    }
+
+    addMissingColumns( true );
+
+}
+
+
+/**
+ * Add columns for any fields the existing table doesn't have yet, with
+ * ALTER TABLE ADD COLUMN. Existing rows get NULL in the new columns,
+ * and are not rewritten, so this is cheap even for huge tables.
+ * Columns of the table that aren't mapped are left alone. If required
+ * is false, failures (e.g. of a read-only file) only produce a
+ * warning.
+ */
+void DatabaseRecord::addMissingColumns( bool required ) {
+
+    std::set<std::string> columns;
+    std::map< std::string, DatabaseField >::iterator it;
+
+    if (catalogColumns( _db, _tablename, columns ) == false) return;
+
+    for (it=_fieldmap->begin(); it != _fieldmap->end(); it++) {
+
+	if (columns.count( lowercase(it->first) )) continue;
+
+	string sql = "ALTER TABLE "+_tablename+" ADD COLUMN "+it->first
+	    +" "+columnType(it->second);
+	if (it->second.primary_key) {
+	    throw runtime_error("addMissingColumns(): can't add primary key '"
+				+it->first+"' to existing table '"
+				+_tablename+"'");
+	}
+
+	cout << "DatabaseRecord: adding column '"<<it->first<<"' to table '"
+	     <<_tablename<<"'"<<endl;
+	int ret = sqlite3_exec( _db, sql.c_str(), NULL, NULL, NULL );
+	catalogChanged( _db );
+	if (ret != SQLITE_OK) {
+	    // it may have just been added through another connection
+	    if (catalogColumns( _db, _tablename, columns, true ) 
+		&& columns.count( lowercase(it->first) )) continue;
+	    if (required)
+		throw runtime_error("addMissingColumns(): '"+sql+"': "
+				    +sqlite3_errmsg(_db));
+	    cout << "WARNING: couldn't add column '"<<it->first<<"': "
+		 << sqlite3_errmsg(_db) <<endl;
+	}
+    }
+
+}
+
+
+/**
+ * Declare an index on the given columns of the table, e.g. 
+ *
+ *	addIndex( {"event_number","telescope_id"} );
+ *
+ * Call this in the constructor, like addField().  Indexes make
+ * lookups by the indexed columns fast, but slow down writing. So by
+ * default (see setDeferIndexes()), when writing into an empty table,
+ * they are dropped when writing starts and built again, in one go, by
+ * finish(). Writes appended to a table with rows keep its indexes up
+ * to date as they go, since rebuilding would cover all the old rows.
+ */
+void DatabaseRecord::addIndex( const std::vector<std::string> &columns ) {
+    _indexes.push_back( columns );
+}
+
+
+/**
+ * \returns true if the table has no rows
+ */
+bool DatabaseRecord::tableEmpty() {
+
+    sqlite3_stmt *stmt;
+    string sql = "SELECT 1 FROM "+_tablename+" LIMIT 1";
+
+    if (sqlite3_prepare_v2( _db, sql.c_str(), -1, &stmt, NULL ) != SQLITE_OK)
+	throw runtime_error("tableEmpty(): '"+sql+"': "+sqlite3_errmsg(_db));
+    int ret = sqlite3_step( stmt );
+    sqlite3_finalize( stmt );
+    if (ret != SQLITE_ROW && ret != SQLITE_DONE)
+	throw runtime_error("tableEmpty(): '"+sql+"': "+sqlite3_errmsg(_db));
+    return ret == SQLITE_DONE;
+
+}
+
+
+/**
+ * \returns the name used for the index on the given columns
+ */
+string DatabaseRecord::getIndexName( const std::vector<std::string> &columns ) {
+
+    string name = _tablename+"_idx";
+    for (size_t i=0; i<columns.size(); i++) {
+	name.append( "_"+columns[i] );
+    }
+    return name;
+
+}
+
+
+/**
+ * Create any declared indexes that don't exist yet. If required is
+ * false, failures (e.g. of a read-only file) only produce a warning.
+ */
+void DatabaseRecord::createIndexes( bool required ) {
+
+    for (size_t i=0; i<_indexes.size(); i++) {
+	string name = getIndexName( _indexes[i] );
+	string sql = "CREATE INDEX IF NOT EXISTS "+name+" ON "+_tablename
+	    +" ("+join(", ",_indexes[i])+")";
+	if (sqlite3_exec( _db, sql.c_str(), NULL, NULL, NULL ) != SQLITE_OK) {
+	    if (required)
+		throw runtime_error("createIndexes(): '"+sql+"': "
+				    +sqlite3_errmsg(_db));
+	    cout << "WARNING: couldn't create index '"<<name<<"': "
+		 << sqlite3_errmsg(_db) <<endl;
+	}
+    }
+
+}
+
+
+/**
+ * Drop all declared indexes (before a bulk write)
+ */
+void DatabaseRecord::dropIndexes() {
+
+    for (size_t i=0; i<_indexes.size(); i++) {
+	string sql = "DROP INDEX IF EXISTS "+getIndexName( _indexes[i] );
+	if (sqlite3_exec( _db, sql.c_str(), NULL, NULL, NULL ) != SQLITE_OK) {
+	    throw runtime_error("dropIndexes(): '"+sql+"': "
+				+sqlite3_errmsg(_db));
+	}
+    }
+
+}
+
+
+/**
+ * Returns true if the table set by setTableName() exists in the database.
+ * Tables made by other connections are seen after the next
+ * checkSchemaVersion().
+ */
+bool DatabaseRecord::tableExists() {
+    
+    std::set<std::string> columns;
+
+    if (_db == NULL) throw runtime_error("NO DATABASE CONNECTION!");
+
+    return catalogColumns( _db, _tablename, columns );
+    
+}
+
+
+/**
+ * clear all the entries in the table (new writes are usually appended)
+ */
+void 
+DatabaseRecord::
+clearTable() {
+    
+    checkSchemaVersion();
+
+    if (tableExists()) {
+	string sql = "DELETE FROM "+_tablename;
+	if (sqlite3_exec( _db, sql.c_str(), NULL,NULL,NULL ) != SQLITE_OK){
+	    throw runtime_error("clearTable(): '"+sql+"': "
+				+sqlite3_errmsg(_db));
+	}
+    }
+
+}
+
+
+/**
+ * Returns the number of rows in the database.
+ *
+ * \param where: an SQL "where" clause.  If not specified, all rows are counted.
+ */
+int 
+DatabaseRecord::
+count(std::string where) {
+    return count( where, QueryParams() );
+}
+
+
+/**
+ * Returns the number of rows matching a where clause containing '?'
+ * placeholders, which are replaced by the values in params, e.g.
+ *
+ *	rec.count( "x<?", {0.5} );
+ *
+ * The statement is cached, so calling this repeatedly with different
+ * values does not parse the SQL again.
+ */
+int 
+DatabaseRecord::
+count(std::string where, const QueryParams &params) {
+    string sql = "SELECT count() FROM "+_tablename;
+    sqlite3_stmt *stmt;
+    int c;
+
+    if (_db == NULL) throw runtime_error("NO DATABASE CONNECTION!");
+
+    flushWrites();
+
+    if (where!="") sql.append(" WHERE "+where);
+
+    stmt = _cache.acquire( _db, sql );
+    if (stmt == NULL) {
+	throw runtime_error("count(): couldn't prepare '"+sql+"': "
+			    +sqlite3_errmsg(_db));
+    }
+    try {
+	bindParams( stmt, params );
+    }
+    catch (runtime_error &e) {
+	_cache.release( sql, stmt );
+	throw;
+    }
+
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+	string err = sqlite3_errmsg(_db);
+	_cache.release( sql, stmt );
+	throw runtime_error("count(): '"+sql+"': "+err);
+    }
+    c=sqlite3_column_int(stmt,0);
+    _cache.release( sql, stmt );
+    
+    return c;
+
+}
+
+
+/**
+ * Running totals of dbr_stats(), kept by sqlite between calls of
+ * statsStep(). Uses Welford's update, which doesn't lose precision
+ * when the mean is large compared to the spread.
+ */
+struct StatsAccumulator {
+    sqlite3_int64 count;
+    double mean, m2, min, max, sum;
+};
+
+static void statsStep( sqlite3_context *context, int /*n=1*/, 
+		       sqlite3_value **val ) {
+
+    if (sqlite3_value_type( val[0] ) == SQLITE_NULL) return;
+
+    StatsAccumulator *acc = (StatsAccumulator*)
+	sqlite3_aggregate_context( context, sizeof(StatsAccumulator) );
+    if (acc == NULL) {
+	sqlite3_result_error_nomem( context );
+	return;
+    }
+
+    double x = sqlite3_value_double( val[0] );
+    if (acc->count == 0 || x < acc->min) acc->min = x;
+    if (acc->count == 0 || x > acc->max) acc->max = x;
+    acc->count++;
+    acc->sum += x;
+    double delta = x - acc->mean;
+    acc->mean += delta/acc->count;
+    acc->m2 += delta*(x - acc->mean);
+
+}
+
+static void statsFinal( sqlite3_context *context ) {
+
+    StatsAccumulator *acc = (StatsAccumulator*)
+	sqlite3_aggregate_context( context, 0 );
+    FieldStatistics st;
+    if (acc != NULL && acc->count > 0) {
+	st.count = acc->count;
+	st.min = acc->min;
+	st.max = acc->max;
+	st.mean = acc->mean;
+	st.sum = acc->sum;
+	st.stddev = sqrt( acc->m2/acc->count );
+    }
+    sqlite3_result_blob( context, &st, sizeof(st), SQLITE_TRANSIENT );
+
+}
+
+
+/**
+ * Bins of dbr_histogram(), allocated by sqlite on the first row (when
+ * the number of bins is known).
+ */
+struct HistogramAccumulator {
+    int nbins;
+    double lo, hi;
+    sqlite3_int64 bins[1];	// really nbins
+};
+
+static void histogramStep( sqlite3_context *context, int /*n=4*/, 
+			   sqlite3_value **val ) {
+
+    int nbins = sqlite3_value_int( val[1] );
+    if (nbins < 1 || nbins > (1<<24)) {
+	sqlite3_result_error( context, "dbr_histogram: bad number of bins", -1 );
+	return;
+    }
+
+    HistogramAccumulator *acc = (HistogramAccumulator*)
+	sqlite3_aggregate_context( context, sizeof(HistogramAccumulator)
+				   + (nbins-1)*sizeof(sqlite3_int64) );
+    if (acc == NULL) {
+	sqlite3_result_error_nomem( context );
+	return;
+    }
+    if (acc->nbins == 0) {
+	acc->nbins = nbins;
+	acc->lo = sqlite3_value_double( val[2] );
+	acc->hi = sqlite3_value_double( val[3] );
+    }
+
+    if (sqlite3_value_type( val[0] ) == SQLITE_NULL) return;
+    double x = sqlite3_value_double( val[0] );
+    if (!(x >= acc->lo && x < acc->hi)) return;
+    int bin = (int)( (x - acc->lo)/(acc->hi - acc->lo)*acc->nbins );
+    if (bin >= acc->nbins) bin = acc->nbins-1;	// rounding at hi
+    acc->bins[bin]++;
+
+}
+
+static void histogramFinal( sqlite3_context *context ) {
+
+    HistogramAccumulator *acc = (HistogramAccumulator*)
+	sqlite3_aggregate_context( context, 0 );
+    if (acc == NULL || acc->nbins == 0) {
+	sqlite3_result_null( context );
+	return;
+    }
+    sqlite3_result_blob( context, acc->bins, acc->nbins*sizeof(sqlite3_int64),
+			 SQLITE_TRANSIENT );
+
+}
+
+
+/**
+ * The connections that have the aggregate functions, i.e. all that
+ * were given to setDatabaseHandle() or opened by Database.
+ */
+struct AggregateRegistry {
+    std::mutex lock;
+    std::set< database_t > dbs;
+};
+
+static AggregateRegistry &aggregateRegistry() {
+    static AggregateRegistry registry;
+    return registry;
+}
+
+static void forgetStats( database_t db );
+
+/**
+ * Called by sqlite when a connection with the aggregate functions is
+ * closed (as the destructor of dbr_stats()): forget everything kept
+ * about it, so a new connection that gets the same address, maybe of
+ * another file, is not mistaken for it. This covers handles opened
+ * with sqlite3_open() as well as those of Database.
+ */
+static void connectionClosed( void *db ) {
+
+    {
+	AggregateRegistry &reg = aggregateRegistry();
+	std::lock_guard<std::mutex> guard( reg.lock );
+	reg.dbs.erase( (database_t) db );
+    }
+    forgetCatalog( (database_t) db );
+    forgetStats( (database_t) db );
+
+}
+
+
+/**
+ * Register the aggregate functions used by DatabaseRecord::stats() and
+ * DatabaseRecord::histogram() with a connection. They can also be
+ * used in SQL directly:
+ *
+ * - dbr_stats(x): a FieldStatistics struct, as a blob
+ * - dbr_histogram(x, nbins, lo, hi): nbins 64-bit counts, as a blob
+ *
+ * Database does this when it opens the file, and
+ * DatabaseRecord::setDatabaseHandle() for any other connection it
+ * is given, once per connection, since (re)registering a function
+ * expires all prepared statements of the connection. Calling it
+ * again for a connection does nothing.
+ */
+void addAggregateFunctions( database_t db ) {
+
+    {
+	AggregateRegistry &reg = aggregateRegistry();
+	std::lock_guard<std::mutex> guard( reg.lock );
+	if (reg.dbs.count( db )) return;
+    }
+
+    // not locked: replacing dbr_stats() calls connectionClosed()
+    if (sqlite3_create_function_v2( db, "dbr_stats", 1, 
+				    SQLITE_UTF8|SQLITE_DETERMINISTIC, db,
+				    NULL, statsStep, statsFinal, 
+				    connectionClosed ) != SQLITE_OK
+	|| sqlite3_create_function( db, "dbr_histogram", 4, 
+				    SQLITE_UTF8|SQLITE_DETERMINISTIC, NULL,
+				    NULL, histogramStep, histogramFinal ) 
+	!= SQLITE_OK) {
+	throw runtime_error("addAggregateFunctions(): "
+			    +string(sqlite3_errmsg(db)));
+    }
+
+    AggregateRegistry &reg = aggregateRegistry();
+    std::lock_guard<std::mutex> guard( reg.lock );
+    reg.dbs.insert( db );
+
+}
+
+
+/**
+ * Run "SELECT expr FROM table WHERE where", which must return one
+ * row, and call result() with the statement positioned on that row.
+ */
+template <class Result>
+static void aggregateQuery( database_t db, StatementCache &cache,
+			    const string &expr, const string &table,
+			    const string &where, const QueryParams &params,
+			    Result result ) {
+
+    string sql = "SELECT "+expr+" FROM "+table;
+    if (where!="") sql.append(" WHERE "+where);
+
+    sqlite3_stmt *stmt = cache.acquire( db, sql );
+    if (stmt == NULL) {
+	throw runtime_error("couldn't prepare '"+sql+"': "+sqlite3_errmsg(db));
+    }
+
+    try {
+	bindParams( stmt, params );
+	if (sqlite3_step(stmt) != SQLITE_ROW) 
+	    throw runtime_error("'"+sql+"': "+sqlite3_errmsg(db));
+	result( stmt );
+    }
+    catch (runtime_error &e) {
+	cache.release( sql, stmt );
+	throw;
+    }
+    cache.release( sql, stmt );
+
+}
+
+
+/**
+ * Count, minimum, maximum, mean and standard deviation of a field (or
+ * any SQL expression of the columns) over the rows matching where,
+ * computed inside sqlite, e.g.
+ *
+ *	FieldStatistics st = p.stats( "size", "telescope_id=?", {1} );
+ *
+ * NULL values are skipped. If no rows match, count is 0 and the other
+ * members are NaN.
+ */
+FieldStatistics
+DatabaseRecord::stats( const std::string &field, std::string where,
+		       const QueryParams &params ) {
+
+    FieldStatistics st;
+
+    if (_db == NULL) throw runtime_error("NO DATABASE CONNECTION!");
+    flushWrites();
+
+    try {
+	aggregateQuery( _db, _cache, "dbr_stats("+field+")", _tablename, 
+			where, params, [&st]( sqlite3_stmt *stmt ) {
+			    if (sqlite3_column_bytes(stmt,0) == sizeof(st))
+				memcpy( &st, sqlite3_column_blob(stmt,0), 
+					sizeof(st) );
+			} );
+    }
+    catch (runtime_error &e) {
+	throw runtime_error(string("stats(): ")+e.what());
+    }
+
+    return st;
+
+}
+
+
+/**
+ * Histogram of a field (or any SQL expression of the columns) over
+ * the rows matching where, filled inside sqlite, e.g.
+ *
+ *	vector<long long> h = p.histogram( "size", 100, 0, 1000 );
+ *
+ * Bin i counts the values in [lo+i*w, lo+(i+1)*w), with w=(hi-lo)/nbins.
+ * Values outside [lo,hi) and NULLs are not counted.
+ */
+std::vector<long long>
+DatabaseRecord::histogram( const std::string &field, int nbins, 
+			   double lo, double hi, std::string where,
+			   const QueryParams &params ) {
+
+    std::vector<long long> bins( nbins>0 ? nbins : 0, 0 );
+    ostringstream expr;
+
+    if (_db == NULL) throw runtime_error("NO DATABASE CONNECTION!");
+    if (nbins < 1 || !(hi > lo))
+	throw runtime_error("histogram(): need nbins>0 and hi>lo");
+    flushWrites();
+
+    // the binning is bound, so the statement can be reused
+    expr << "dbr_histogram(" << field << ", ?, ?, ?)";
+    QueryParams all;
+    all.push_back( nbins );
+    all.push_back( lo );
+    all.push_back( hi );
+    all.insert( all.end(), params.begin(), params.end() );
+
+    try {
+	aggregateQuery( _db, _cache, expr.str(), _tablename, where, all,
+			[&bins,nbins]( sqlite3_stmt *stmt ) {
+			    if (sqlite3_column_bytes(stmt,0) 
+				== (int)(nbins*sizeof(sqlite3_int64)))
+				memcpy( &bins[0], sqlite3_column_blob(stmt,0),
+					nbins*sizeof(sqlite3_int64) );
+			} );
+    }
+    catch (runtime_error &e) {
+	throw runtime_error(string("histogram(): ")+e.what());
+    }
+
+    return bins;
+
+}
+
+/**
+ * Get the smallest and largest rowid in the table, e.g. to split it
+ * into ranges (see parallelRead()).
+ *
+ * \returns false if the table is empty
+ */
+bool
+DatabaseRecord::
+getRowidRange( sqlite3_int64 &first, sqlite3_int64 &last ) {
+    string sql = "SELECT min(rowid), max(rowid) FROM "+_tablename;
+    sqlite3_stmt *stmt;
+    bool found=false;
+
+    if (_db == NULL) throw runtime_error("NO DATABASE CONNECTION!");
+
+    flushWrites();
+
+    if (sqlite3_prepare_v2(_db,sql.c_str(),sql.length(),&stmt,NULL) 
+	!= SQLITE_OK) {
+	throw runtime_error("getRowidRange(): '"+sql+"': "
+			    +sqlite3_errmsg(_db));
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW 
+	&& sqlite3_column_type(stmt,0) != SQLITE_NULL) {
+	first = sqlite3_column_int64(stmt,0);
+	last = sqlite3_column_int64(stmt,1);
+	found = true;
+    }
+    sqlite3_finalize(stmt);
+    
+    return found;
+
+}
+
+/**
+ * Bind the values in params to the '?' placeholders of stmt, in order.
+ */
+void bindParams( sqlite3_stmt *stmt, const QueryParams &params ) {
+
+    if ((size_t)sqlite3_bind_parameter_count(stmt) != params.size()) {
+	ostringstream msg;
+	msg << "bindParams(): "<<params.size()<<" values given for "
+	    << sqlite3_bind_parameter_count(stmt)<<" placeholders in '"
+	    << sqlite3_sql(stmt) << "'";
+	throw runtime_error( msg.str() );
+    }
+
+    for (size_t i=0; i<params.size(); i++) {
+	switch (params[i].type) {
+	case FIELD_INT:
+	    sqlite3_bind_int( stmt, i+1, params[i].ival );
+	    break;
+	case FIELD_INT64:
+	    sqlite3_bind_int64( stmt, i+1, params[i].lval );
+	    break;
+	case FIELD_DOUBLE:
+	    sqlite3_bind_double( stmt, i+1, params[i].dval );
+	    break;
+	case FIELD_STRING:
+	case FIELD_STRING_VIEW:
+	    sqlite3_bind_text( stmt, i+1, params[i].sval.c_str(),
+			       params[i].sval.length(), SQLITE_TRANSIENT );
+	    break;
+	default:
+	    throw runtime_error(string("bindParams(): unsupported value type "
+				       "for '")+sqlite3_sql(stmt)+"'");
+	}
+    }
+
+}
+
+
+/**
+ * Get a prepared statement for sql, either from the cache or by
+ * preparing it.
+ *
+ * \returns NULL if the statement could not be prepared
+ */
+sqlite3_stmt *
+StatementCache::acquire( database_t db, const std::string &sql ) {
+
+    sqlite3_stmt *stmt=NULL;
+    std::map< std::string, StatementList::iterator >::iterator it;
+
+    it = _index.find( sql );
+    if (it != _index.end()) {
+	stmt = it->second->second;
+	_lru.erase( it->second );
+	_index.erase( it );
+	return stmt;
+    }
+
+    if (sqlite3_prepare_v2( db, sql.c_str(), sql.length(), &stmt, NULL ) 
+	!= SQLITE_OK) {
+	sqlite3_finalize( stmt );
+	return NULL;
+    }
+
+    return stmt;
+
+}
+
+
+/**
+ * Give a statement from acquire() back to the cache.
+ */
+void 
+StatementCache::release( const std::string &sql, sqlite3_stmt *stmt ) {
+
+    if (stmt == NULL) return;
+
+    sqlite3_reset( stmt );
+    sqlite3_clear_bindings( stmt );
+
+    if (_capacity == 0 || _index.find(sql) != _index.end()) {
+	sqlite3_finalize( stmt );
+	return;
+    }
+
+    _lru.push_front( std::make_pair(sql, stmt) );
+    _index[sql] = _lru.begin();
+
+    while (_lru.size() > _capacity) {
+	sqlite3_finalize( _lru.back().second );
+	_index.erase( _lru.back().first );
+	_lru.pop_back();
+    }
+
+}
+
+
+/**
+ * Finalize all cached statements
+ */
+void StatementCache::clear() {
+
+    StatementList::iterator it;
+    for (it=_lru.begin(); it != _lru.end(); it++) {
+	sqlite3_finalize( it->second );
+    }
+    _lru.clear();
+    _index.clear();
+
+}
+
+
+/**
+ * Set the maximum number of statements kept in the cache (0 disables
+ * caching).
+ */
+void StatementCache::setCapacity( size_t capacity ) {
+
+    _capacity = capacity;
+    while (_lru.size() > _capacity) {
+	sqlite3_finalize( _lru.back().second );
+	_index.erase( _lru.back().first );
+	_lru.pop_back();
+    }
+
+}
+
+
+string join( std::string delim, std::vector< std::string > &strvect ) {
+    int i;
+    string str;
+
+    if (strvect.size() == 1) { return strvect[0]; }
+    for (i=0; i<strvect.size()-1; i++) {
+	str.append(strvect[i]+delim);
+    }
+    str.append(strvect[i]);
+    return str;
+}
+
+
+/**
+ * Prints out all currently mapped values. Just helpful for debugging. 
  */
 ostream&
 DatabaseRecord::
@@ -392,20 +3067,38 @@ print(ostream& stream) {
     
     std::map< std::string, DatabaseField >::iterator it;
     
-    for (it=_fieldmap.begin(); it != _fieldmap.end(); it++) {
+    for (it=_fieldmap->begin(); it != _fieldmap->end(); it++) {
 	stream << it->first << ":  ";
 	switch (it->second.type) {
 	case FIELD_INT:
-	    stream << *((int*)it->second.ptr);
+	    stream << *((int*)fieldPtr(it->second));
 	    break;
 	case FIELD_DOUBLE:
-	    stream <<  *((double*)it->second.ptr);
+	    stream <<  *((double*)fieldPtr(it->second));
+	    break;
+	case FIELD_INT64:
+	    stream << *((int64_t*)fieldPtr(it->second));
+	    break;
+	case FIELD_FLOAT:
+	    stream << *((float*)fieldPtr(it->second));
+	    break;
+	case FIELD_INT16:
+	    stream << *((int16_t*)fieldPtr(it->second));
+	    break;
+	case FIELD_BOOL:
+	    stream << *((bool*)fieldPtr(it->second));
 	    break;
 	case FIELD_STRING:
-	    stream << "'"<<*((std::string*)it->second.ptr)<<"'";
+	    stream << "'"<<*((std::string*)fieldPtr(it->second))<<"'";
+	    break;
+	case FIELD_STRING_VIEW:
+	    stream << "'"<<*((std::string_view*)fieldPtr(it->second))<<"'";
+	    break;
+	case FIELD_BLOB:
+	    stream << "<" << blobBytes(it->second) << " bytes>";
 	    break;
 	}
-	stream << endl;
+	stream << '\n';
     }
     return stream;
 }
@@ -418,17 +3111,44 @@ void
 DatabaseRecord::
 zero() {
     std::map< std::string, DatabaseField >::iterator it;
+
+    if (_codec && _use_codec) {
+	_codec->zero( *this );
+	return;
+    }
 	
-    for (it=_fieldmap.begin(); it != _fieldmap.end(); it++) {
+    for (it=_fieldmap->begin(); it != _fieldmap->end(); it++) {
 	switch (it->second.type) {
 	case FIELD_INT:
-	    *((int*)it->second.ptr) = 0;
+	    *((int*)fieldPtr(it->second)) = 0;
 	    break;
 	case FIELD_DOUBLE:
-	    *((double*)it->second.ptr) = 0.0;
+	    *((double*)fieldPtr(it->second)) = 0.0;
+	    break;
+	case FIELD_INT64:
+	    *((int64_t*)fieldPtr(it->second)) = 0;
+	    break;
+	case FIELD_FLOAT:
+	    *((float*)fieldPtr(it->second)) = 0.0;
+	    break;
+	case FIELD_INT16:
+	    *((int16_t*)fieldPtr(it->second)) = 0;
+	    break;
+	case FIELD_BOOL:
+	    *((bool*)fieldPtr(it->second)) = false;
 	    break;
 	case FIELD_STRING:
-	    *((string*)it->second.ptr) = "";
+	    *((string*)fieldPtr(it->second)) = "";
+	    break;
+	case FIELD_STRING_VIEW:
+	    *((std::string_view*)fieldPtr(it->second)) = std::string_view();
+	    break;
+	case FIELD_BLOB:
+	    // an array with a count is emptied by its count alone
+	    if (it->second.count_offset >= 0)
+		*((int*)((char*) this + it->second.count_offset)) = 0;
+	    else
+		memset( fieldPtr(it->second), 0, it->second.size );
 	    break;
 	}
     }
@@ -437,3 +3157,345 @@ zero() {
 std::ostream& operator<<( std::ostream &stream,DatabaseRecord &rec ) {
     return rec.print(stream);
 }
+
+
+
+/**
+ * All DatabaseRecords with a database handle, and the summed counters
+ * of those that have been destroyed, so Database::getStats() can
+ * report on every table used through a connection.
+ */
+struct StatsRegistry {
+    std::mutex lock;
+    std::multimap< database_t, DatabaseRecord* > live;
+    std::map< std::pair<database_t,std::string>, DatabaseRecordStats > retired;
+};
+
+static StatsRegistry &statsRegistry() {
+    static StatsRegistry registry;
+    return registry;
+}
+
+
+/**
+ * Add this record to the registry of its database handle
+ */
+void DatabaseRecord::registerStats() {
+
+    if (_db == NULL) return;
+
+    StatsRegistry &reg = statsRegistry();
+    std::lock_guard<std::mutex> guard( reg.lock );
+    reg.live.insert( std::make_pair( _db, this ) );
+
+}
+
+
+/**
+ * Remove this record from the registry, keeping its counters
+ */
+void DatabaseRecord::unregisterStats() {
+
+    if (_db == NULL) return;
+
+    StatsRegistry &reg = statsRegistry();
+    std::lock_guard<std::mutex> guard( reg.lock );
+    std::multimap< database_t, DatabaseRecord* >::iterator it;
+    for (it=reg.live.lower_bound(_db); it != reg.live.upper_bound(_db); it++) {
+	if (it->second == this) {
+	    reg.live.erase( it );
+	    DatabaseRecordStats &sum = reg.retired[ make_pair(_db,_tablename) ];
+	    sum.table = _tablename;
+	    sum += getStats();
+	    break;
+	}
+    }
+
+}
+
+
+/**
+ * \returns the performance counters of this record, since it was
+ * created or resetStats() was called. The counters are always on,
+ * and may be read from any thread while the record is in use.
+ */
+DatabaseRecordStats DatabaseRecord::getStats() {
+
+    DatabaseRecordStats st;
+
+    st.table = _tablename;
+    st.rows_written = _rows_written.get();
+    st.rows_read = _rows_read.get();
+    st.bytes_bound = _bytes_bound.get();
+    st.retries = _retries.get();
+    st.busy_time = _busy_ns.get()*1e-9;
+    st.commits = _commits.get();
+    st.bind_time = _bind_ns.get()*1e-9;
+    st.step_time = _step_ns.get()*1e-9;
+    st.reset_time = _reset_ns.get()*1e-9;
+    st.commit_time = _commit_ns.get()*1e-9;
+    st.max_commit_time = _max_commit_ns.get()*1e-9;
+    return st;
+
+}
+
+
+/**
+ * Set all performance counters of this record to zero
+ */
+void DatabaseRecord::resetStats() {
+
+    _rows_written.reset();
+    _rows_read.reset();
+    _bytes_bound.reset();
+    _retries.reset();
+    _busy_ns.reset();
+    _commits.reset();
+    _bind_ns.reset();
+    _step_ns.reset();
+    _reset_ns.reset();
+    _commit_ns.reset();
+    _max_commit_ns.reset();
+
+}
+
+
+/**
+ * \returns the performance counters of every table used through this
+ * connection, summed over all records (live or destroyed) of each
+ * table.
+ */
+std::vector<DatabaseRecordStats> Database::getStats() {
+
+    std::map< std::string, DatabaseRecordStats > tables;
+    std::vector<DatabaseRecordStats> result;
+
+    StatsRegistry &reg = statsRegistry();
+    std::lock_guard<std::mutex> guard( reg.lock );
+
+    std::map< std::pair<database_t,std::string>, 
+	DatabaseRecordStats >::iterator rt;
+    for (rt=reg.retired.begin(); rt != reg.retired.end(); rt++) {
+	if (rt->first.first == _db) tables[rt->first.second] += rt->second;
+    }
+
+    std::multimap< database_t, DatabaseRecord* >::iterator it;
+    for (it=reg.live.lower_bound(_db); it != reg.live.upper_bound(_db); it++) {
+	DatabaseRecordStats st = it->second->getStats();
+	tables[st.table] += st;
+    }
+
+    std::map< std::string, DatabaseRecordStats >::iterator t;
+    for (t=tables.begin(); t != tables.end(); t++) {
+	t->second.table = t->first;
+	result.push_back( t->second );
+    }
+    return result;
+
+}
+
+
+/**
+ * Drop the counters kept for a connection (when it is closed, so a
+ * new connection that gets the same handle starts from zero).
+ */
+static void forgetStats( database_t db ) {
+
+    StatsRegistry &reg = statsRegistry();
+    std::lock_guard<std::mutex> guard( reg.lock );
+
+    std::map< std::pair<database_t,std::string>, 
+	DatabaseRecordStats >::iterator rt;
+    for (rt=reg.retired.begin(); rt != reg.retired.end(); ) {
+	if (rt->first.first == db) reg.retired.erase( rt++ );
+	else rt++;
+    }
+    reg.live.erase( db );
+
+}
+
+void Database::forgetStats() {
+    ::forgetStats( _db );
+}
+
+
+DatabaseRecordStats &
+DatabaseRecordStats::operator+=( const DatabaseRecordStats &other ) {
+
+    rows_written += other.rows_written;
+    rows_read += other.rows_read;
+    bytes_bound += other.bytes_bound;
+    retries += other.retries;
+    busy_time += other.busy_time;
+    commits += other.commits;
+    bind_time += other.bind_time;
+    step_time += other.step_time;
+    reset_time += other.reset_time;
+    commit_time += other.commit_time;
+    max_commit_time = std::max( max_commit_time, other.max_commit_time );
+    return *this;
+
+}
+
+
+std::ostream& operator<<( std::ostream &stream, 
+			  const DatabaseRecordStats &st ) {
+    stream << st.table << ": "
+	   << st.rows_written << " rows written, "
+	   << st.rows_read << " read, "
+	   << st.bytes_bound << " bytes bound, "
+	   << st.retries << " retries ("<<st.busy_time<<" s); "
+	   << "bind " << st.bind_time << " s, "
+	   << "step " << st.step_time << " s, "
+	   << "reset " << st.reset_time << " s; "
+	   << st.commits << " commits in " << st.commit_time << " s "
+	   << "(max " << st.max_commit_time << " s)";
+    return stream;
+}
+
+
+/**
+ * Write the given counters (e.g. from Database::getStats()) as a
+ * JSON array, one object per table.
+ */
+void writeStatsJSON( std::ostream &stream, 
+		     const std::vector<DatabaseRecordStats> &stats ) {
+
+    stream << "[";
+    for (size_t i=0; i<stats.size(); i++) {
+	const DatabaseRecordStats &st = stats[i];
+	stream << (i ? ",\n " : "\n ")
+	       << "{\"table\": \"" << st.table << "\""
+	       << ", \"rows_written\": " << st.rows_written
+	       << ", \"rows_read\": " << st.rows_read
+	       << ", \"bytes_bound\": " << st.bytes_bound
+	       << ", \"retries\": " << st.retries
+	       << ", \"busy_time\": " << st.busy_time
+	       << ", \"commits\": " << st.commits
+	       << ", \"bind_time\": " << st.bind_time
+	       << ", \"step_time\": " << st.step_time
+	       << ", \"reset_time\": " << st.reset_time
+	       << ", \"commit_time\": " << st.commit_time
+	       << ", \"max_commit_time\": " << st.max_commit_time << "}";
+    }
+    stream << "\n]\n";
+
+}
+
+
+
+/**
+ * Set up a join of the tables of the given records, which must all
+ * have their database handle set to the same connection. The records
+ * must stay alive as long as the DatabaseJoin is used. For example,
+ * to read simulated showers together with their reconstructed
+ * parameters:
+ *
+ *	DatabaseJoin events( {&sim, &param} );
+ *	events.prepareToRead( "simdata.primary_energy > ?", {1.0} );
+ *	while (events.readFromDatabase()) { ... }
+ *
+ * Column names that exist in more than one table must be qualified
+ * with the table name in the where clause.
+ */
+DatabaseJoin::DatabaseJoin( const std::vector<DatabaseRecord*> &records,
+			    const std::vector<std::string> &using_columns )
+    : _records(records), _using(using_columns), _db(NULL), _stmt(NULL)
+{
+
+    if (_records.empty()) throw runtime_error("DatabaseJoin: no records");
+
+    _db = _records[0]->_db;
+    for (size_t i=0; i<_records.size(); i++) {
+	if (_records[i]->_db == NULL || _records[i]->_db != _db)
+	    throw runtime_error("DatabaseJoin: records must share one "
+				"database connection");
+    }
+
+}
+
+
+/**
+ * Prepare the joined SELECT. The where clause may contain '?'
+ * placeholders, as for DatabaseRecord::prepareToRead().
+ */
+void
+DatabaseJoin::prepareToRead( std::string where_clause,
+			     const QueryParams &params ) {
+
+    vector<string> fields;
+    string sql;
+    int ncols=0;
+
+    finish();
+
+    _first.clear();
+    for (size_t i=0; i<_records.size(); i++) {
+	_records[i]->flushWrites();
+	fields.push_back( _records[i]->getQualifiedFieldList() );
+	_first.push_back( ncols );
+	ncols += _records[i]->getNumFields();
+    }
+
+    sql = "SELECT "+join(", ",fields)+" FROM "+_records[0]->getTableName();
+    for (size_t i=1; i<_records.size(); i++) {
+	sql.append(" JOIN "+_records[i]->getTableName()
+		   +" USING ("+join(", ",_using)+")");
+    }
+    if (where_clause != "") {
+	sql.append(" WHERE "+where_clause );
+    }
+
+    if (sqlite3_prepare_v2( _db, sql.c_str(), sql.length(), &_stmt, NULL )
+	!= SQLITE_OK) {
+	string err = sqlite3_errmsg(_db);
+	sqlite3_finalize( _stmt );
+	_stmt = NULL;
+	throw runtime_error("DatabaseJoin: couldn't prepare '"+sql+"': "+err);
+    }
+
+    bindParams( _stmt, params );
+
+}
+
+
+/**
+ * Fill all records with the next row of the join.
+ *
+ * \returns 0 if no more rows are available, 1 if a row was read successfully.
+ */
+int
+DatabaseJoin::readFromDatabase() {
+
+    int ret;
+
+    if (_stmt == NULL) 
+	throw runtime_error("DatabaseJoin: prepareToRead() wasn't called");
+
+    ret = sqlite3_step( _stmt );
+    if (ret == SQLITE_ROW) {
+	for (size_t i=0; i<_records.size(); i++) {
+	    _records[i]->fetchFields( _stmt, _first[i] );
+	    _records[i]->_rows_read.add(1);
+	}
+	return 1;
+    }
+    else if (ret == SQLITE_DONE) {
+	return 0;
+    }
+    else {
+	throw runtime_error(string("DatabaseJoin::readFromDatabase() step: ")
+			    +sqlite3_errmsg(_db));
+    }
+
+}
+
+
+/**
+ * Finish reading (also done by the destructor)
+ */
+void
+DatabaseJoin::finish() {
+    if (_stmt) sqlite3_finalize( _stmt );
+    _stmt = NULL;
+}
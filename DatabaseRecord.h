@@ -6,22 +6,337 @@
 #ifndef DATABASERECORD_H
 #define DATABASERECORD_H
 
+#include <iostream>
 #include <map>
+#include <list>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <sqlite3.h>
 #include <stdexcept>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <cstddef>
+#include <type_traits>
+#include <functional>
+#include <cstdint>
 
-enum DatabaseFieldType {FIELD_INT, FIELD_DOUBLE, FIELD_STRING};
+enum DatabaseFieldType {FIELD_INT, FIELD_DOUBLE, FIELD_STRING, 
+			FIELD_STRING_VIEW, FIELD_BLOB, FIELD_INT64,
+			FIELD_FLOAT, FIELD_INT16, FIELD_BOOL};
+
+typedef sqlite3* database_t ;
 
 struct DatabaseField {
-    void *ptr;
+    DatabaseField() : offset(0), type(FIELD_INT), primary_key(false),
+	size(0), elemsize(0), count_offset(-1), lazy(false) {;}
+    std::ptrdiff_t offset;	//!< position of the variable in the record
     DatabaseFieldType type;
     bool primary_key;
+    size_t size;		//!< bytes of the array (FIELD_BLOB only)
+    size_t elemsize;		//!< bytes per array element
+    std::ptrdiff_t count_offset; //!< position of the element count, or -1
+    bool lazy;			//!< read only by readBlob(), see setLazy()
 };
 
+/**
+ * Holds a copy of the value of one mapped field.  Only the member
+ * matching the field's DatabaseFieldType is used.
+ */
+struct DatabaseValue {
+    int ival;			//!< also int16 and bool
+    double dval;		//!< also float
+    std::string sval;		//!< text, or the bytes of a blob
+    sqlite3_int64 lval;		//!< int64, or the rowid of a row with lazy fields
+};
+
+/**
+ * A snapshot of all mapped fields of a DatabaseRecord, in field map
+ * order. Used to buffer rows that are written to the database later.
+ */
+typedef std::vector<DatabaseValue> DatabaseRow;
+
+/**
+ * A value for a '?' placeholder in a where clause, see
+ * DatabaseRecord::count() and DatabaseRecord::prepareToRead().
+ */
+struct QueryParam {
+    QueryParam( int val ) : type(FIELD_INT), ival(val) {;}
+    QueryParam( int64_t val ) : type(FIELD_INT64), lval(val) {;}
+    QueryParam( double val ) : type(FIELD_DOUBLE), dval(val) {;}
+    QueryParam( const char *val ) : type(FIELD_STRING), sval(val) {;}
+    QueryParam( const std::string &val ) : type(FIELD_STRING), sval(val) {;}
+    DatabaseFieldType type;
+    int ival;
+    int64_t lval;
+    double dval;
+    std::string sval;
+};
+
+typedef std::vector<QueryParam> QueryParams;
+
+void bindParams( sqlite3_stmt *stmt, const QueryParams &params );
+
+
+/**
+ * A least-recently-used cache of prepared statements, keyed by their
+ * SQL text, so that repeated queries don't have to be parsed
+ * again. A statement is taken out of the cache with acquire() while
+ * it is in use, and put back (reset, with bindings cleared) with
+ * release().  When the cache is full, the least recently released
+ * statement is finalized.
+ */
+class StatementCache {
+
+ public:
+    StatementCache( size_t capacity=16 ) : _capacity(capacity) {;}
+    ~StatementCache() { clear(); }
+
+    sqlite3_stmt *acquire( database_t db, const std::string &sql );
+    void release( const std::string &sql, sqlite3_stmt *stmt );
+    void clear();
+    void setCapacity( size_t capacity );
+    size_t size() { return _lru.size(); }
+
+ private:
+    StatementCache( const StatementCache& );
+    StatementCache &operator=( const StatementCache& );
+
+    typedef std::list< std::pair<std::string,sqlite3_stmt*> > StatementList;
+    StatementList _lru;	//!< most recently used first
+    std::map< std::string, StatementList::iterator > _index;
+    size_t _capacity;
+
+};
+
+
+/**
+ * One column of values read by DatabaseRecord::readColumns(). Only
+ * the vector matching the field's type is filled.
+ */
+struct DatabaseColumn {
+    DatabaseFieldType type;
+    std::vector<int> ints;	//!< also int16 and bool fields
+    std::vector<int64_t> int64s;
+    std::vector<double> doubles;
+    std::vector<float> floats;
+    std::vector<std::string> strings;
+};
+
+/**
+ * A set of columns (one contiguous vector per field) read by
+ * DatabaseRecord::readColumns(). Access them by field name and type,
+ * e.g. cols.get<double>("size")[i]
+ */
+class DatabaseColumns {
+
+ public:
+    DatabaseColumns() : _nrows(0) {;}
+
+    /// number of rows read
+    size_t size() const { return _nrows; }
+    bool has( const std::string &name ) const {
+	return _columns.find(name) != _columns.end();
+    }
+    template <class T> const std::vector<T> &get( const std::string &name ) const;
+
+ private:
+    friend class DatabaseRecord;
+    const DatabaseColumn &column( const std::string &name, 
+				  DatabaseFieldType type ) const;
+    std::map< std::string, DatabaseColumn > _columns;
+    size_t _nrows;
+
+};
+
+template <> inline const std::vector<int>& 
+DatabaseColumns::get<int>( const std::string &name ) const {
+    return column( name, FIELD_INT ).ints;
+}
+
+template <> inline const std::vector<int64_t>& 
+DatabaseColumns::get<int64_t>( const std::string &name ) const {
+    return column( name, FIELD_INT64 ).int64s;
+}
+
+template <> inline const std::vector<double>& 
+DatabaseColumns::get<double>( const std::string &name ) const {
+    return column( name, FIELD_DOUBLE ).doubles;
+}
+
+template <> inline const std::vector<float>& 
+DatabaseColumns::get<float>( const std::string &name ) const {
+    return column( name, FIELD_FLOAT ).floats;
+}
+
+template <> inline const std::vector<std::string>& 
+DatabaseColumns::get<std::string>( const std::string &name ) const {
+    return column( name, FIELD_STRING ).strings;
+}
+
+
+/**
+ * Memory for the text of std::string_view fields that must outlive
+ * the current row, see DatabaseRecord::useStringArena(). Strings are
+ * copied into large blocks instead of being allocated one by one.
+ */
+class StringArena {
+
+ public:
+    StringArena( size_t blocksize=65536 ) 
+	: _blocksize(blocksize), _current(0), _used(0) {;}
+    std::string_view store( const char *data, size_t n );
+    void clear();
+
+ private:
+    std::vector< std::vector<char> > _blocks;
+    std::vector< std::vector<char> > _large; //!< strings > blocksize
+    size_t _blocksize;
+    size_t _current;	//!< block being filled
+    size_t _used;	//!< bytes used in the current block
+
+};
+
+
+class DatabaseRecord;
+class RowQueue;
+
+/**
+ * Interface for code that binds/reads all fields of a particular
+ * DatabaseRecord subclass directly, rather than through the field
+ * map. See RecordSchema.h.
+ */
+class FieldCodec {
+ public:
+    virtual ~FieldCodec() {}
+    virtual size_t bind( DatabaseRecord &rec, sqlite3_stmt *stmt, 
+			 int first ) const = 0;
+    virtual void fetch( DatabaseRecord &rec, sqlite3_stmt *stmt, 
+			int first ) const = 0;
+    virtual void zero( DatabaseRecord &rec ) const = 0;
+};
+
+/**
+ * Presets for the trade-off between durability and write speed, see
+ * Database::setDurability()
+ */
+enum DurabilityProfile {
+    DURABILITY_DEFAULT,	  //!< sqlite defaults: rollback journal, full sync
+    DURABILITY_BULK_LOAD, //!< WAL, no sync, rare checkpoints: fast ingest
+    DURABILITY_SAFE,	  //!< WAL, full sync, frequent checkpoints
+    DURABILITY_IN_MEMORY  //!< journal in memory, no sync: scratch data only
+};
+
+/**
+ * Connection settings applied by Database when the file is opened.
+ * Values of -1 leave the sqlite default (or the setting stored in
+ * the file) alone. Database::getOptions() reports the values
+ * actually in effect.
+ */
+struct DatabaseOptions {
+
+    DatabaseOptions() : page_size(-1), cache_kb(-1), mmap_size(-1),
+	temp_store(-1), wal(false), exclusive(false), threads(-1),
+	busy_timeout(30000) {;}
+
+    int page_size;	   //!< bytes per page (new files only, before WAL)
+    int cache_kb;	   //!< size of the page cache in KiB
+    sqlite3_int64 mmap_size; //!< bytes of the file to access via mmap
+    int temp_store;	   //!< temp tables/indices: 0=default, 1=file, 2=memory
+    bool wal;		   //!< use a write-ahead log (journal_mode=WAL)
+    bool exclusive;	   //!< keep the file locked (locking_mode=EXCLUSIVE)
+    int threads;	   //!< helper threads sqlite may use for sorting
+    int busy_timeout;	   //!< ms to wait for locks of other connections
+
+};
+
+std::ostream& operator<<( std::ostream &stream, const DatabaseOptions &opt );
+
+void setBusyTimeout( database_t db, int msec );
+
+
+/**
+ * A counter that may be changed and read from any thread (e.g. the
+ * writer thread and the one calling resetStats()). Updates are
+ * atomic, but relaxed: the counters order nothing else.
+ */
+class StatCounter {
+
+ public:
+    StatCounter() : _value(0) {;}
+
+    void add( long long n ) { 
+	_value.fetch_add( n, std::memory_order_relaxed );
+    }
+    void max( long long n ) {
+	long long old = _value.load(std::memory_order_relaxed);
+	while (n > old 
+	       && !_value.compare_exchange_weak( old, n, 
+						 std::memory_order_relaxed ))
+	    ;
+    }
+    long long get() const { return _value.load(std::memory_order_relaxed); }
+    /// \returns the value before
+    long long reset() { 
+	return _value.exchange( 0, std::memory_order_relaxed ); 
+    }
+
+ private:
+    std::atomic<long long> _value;
+
+};
+
+/**
+ * Summary of the values of a field, see DatabaseRecord::stats()
+ */
+struct FieldStatistics {
+    FieldStatistics() : count(0), min(NAN), max(NAN), mean(NAN),
+	stddev(NAN), sum(0) {;}
+    long long count;	       //!< number of (non-NULL) values
+    double min;
+    double max;
+    double mean;
+    double stddev;	       //!< standard deviation (of the values, not the mean)
+    double sum;
+};
+
+void addAggregateFunctions( database_t db );
+
+/**
+ * Performance counters of a table, see DatabaseRecord::getStats()
+ * and Database::getStats(). Times are in seconds.
+ */
+struct DatabaseRecordStats {
+
+    DatabaseRecordStats() : rows_written(0), rows_read(0), bytes_bound(0),
+	retries(0), commits(0), busy_time(0), bind_time(0), step_time(0),
+	reset_time(0), commit_time(0), max_commit_time(0) {;}
+
+    std::string table;
+    long long rows_written;
+    long long rows_read;
+    long long bytes_bound;     //!< bytes of field data bound for writing
+    long long retries;	       //!< waits for locks of other connections
+    long long commits;	       //!< transactions committed
+    double busy_time;	       //!< total time spent waiting for locks
+    double bind_time;	       //!< binding values to INSERT statements
+    double step_time;	       //!< executing INSERT statements
+    double reset_time;	       //!< resetting INSERT statements
+    double commit_time;	       //!< total time in COMMIT
+    double max_commit_time;    //!< longest single COMMIT
+
+    DatabaseRecordStats &operator+=( const DatabaseRecordStats &other );
+
+};
+
+std::ostream& operator<<( std::ostream &stream, 
+			  const DatabaseRecordStats &stats );
+void writeStatsJSON( std::ostream &stream, 
+		     const std::vector<DatabaseRecordStats> &stats );
 
-typedef sqlite3* database_t ;
 
 /**
  * Wrapper class for the database; eventually, this should encapsulate
@@ -31,23 +346,47 @@ typedef sqlite3* database_t ;
 class Database {
 
  public:
-    Database( std::string filename ) {
+    Database( std::string filename, 
+	      const DatabaseOptions &options=DatabaseOptions() ) 
+	: _filename(filename), _busy_timeout(0) {
 	if (sqlite3_open( filename.c_str(), &_db )) {
 	    throw std::runtime_error("Couldn't open database '"+filename
 				+"' because: "+sqlite3_errmsg(_db));
 	}
+	try {
+	    setOptions( options );
+	    addAggregateFunctions( _db );
+	}
+	catch (std::runtime_error &e) {
+	    sqlite3_close(_db);
+	    throw;
+	}
    }
 
     ~Database() {
+	forgetStats();
+	forgetCatalog();
 	if (sqlite3_close(_db))
 	    std::cout << "CLOSE: "<<sqlite3_errmsg(_db)<<std::endl;
 	
     }
 
     database_t getHandle() {return _db;}
+    const std::string &getFilename() {return _filename;}
+    void setDurability( DurabilityProfile profile );
+    void setOptions( const DatabaseOptions &options );
+    DatabaseOptions getOptions();
+    std::vector<DatabaseRecordStats> getStats();
     
  private:
+    void forgetStats();
+    void forgetCatalog();
+    sqlite3_int64 pragma( const std::string &name );
+    std::string pragmaText( const std::string &name );
+
     database_t _db;
+    std::string _filename;
+    int _busy_timeout;
 
 
 };
@@ -65,6 +404,13 @@ class Database {
  * DatabaseRecord methods from your new class to write and read the
  * data.
  *
+ * The mapped variables must be members of your subclass: they are
+ * found by their position within the record, so a copy of a record
+ * (e.g. an element of a std::vector) reads and writes its own
+ * members.  Assigning one record to another copies only the
+ * subclass's members (the mapped values), not the connection,
+ * settings or state of the record.
+ *
  * Before doing anything with your subclass of DatabaseRecord, you
  * must call the setDatabaseHandle() function and pass it a pointer to
  * an open database, otherwise the read and write functions will fail.
@@ -75,70 +421,361 @@ class DatabaseRecord {
 
  public:
     
-    DatabaseRecord(): _write_in_progress(false),_read_in_progress(false),
-	_writecount(0), _db(NULL),_tablename("unnamed_table"),
-	_badcount(0){;}
-    ~DatabaseRecord(){ finish();}
+    DatabaseRecord(): _db(NULL), _rdstmt(NULL), _wrstmt(NULL), _batchstmt(NULL),
+	_tablename("unnamed_table"),
+	_fieldmap( std::make_shared< std::map<std::string,DatabaseField> >() ),
+	_rowid_col(-1), _rdrowid(0),
+	_write_in_progress(false),_read_in_progress(false), _writecount(0),
+	_batchsize(1), _batchfill(0), _codec(NULL), _use_codec(true),
+	_commit_rows(0), _commit_bytes(0), _commit_msec(0),
+	_pending_rows(0), _pending_bytes(0),
+	_asyncslots(0), _queue(NULL), _writer(NULL), _prefetchslots(0),
+	_rdqueue(NULL), _reader(NULL), _rdrow(NULL), _arena(NULL),
+	_defer_indexes(true), _indexes_dropped(false) {;}
+    DatabaseRecord( const DatabaseRecord &other );
+    DatabaseRecord &operator=( const DatabaseRecord &other );
+    ~DatabaseRecord(){ 
+	try {
+	    finish();
+	}
+	catch (std::runtime_error &e) {
+	    std::cout << "ERROR: "<<e.what()<<std::endl;
+	}
+	unregisterStats(); 
+	delete _arena; 
+    }
 
     void prepareToRead( std::string where_clause="" );
+    void prepareToRead( std::string where_clause, const QueryParams &params );
     int  readFromDatabase();
+    bool readBlob( const std::string &field );
+    template <class Record> 
+    std::vector<Record> readAll( std::string where_clause="",
+				 const QueryParams &params=QueryParams() );
+    DatabaseColumns readColumns( const std::vector<std::string> &fields,
+				 std::string where_clause="",
+				 const QueryParams &params=QueryParams() );
     void writeToDatabase();
     void setDatabaseHandle( database_t db ){
+	unregisterStats();
 	_db=db; 
+	registerStats();
+	addAggregateFunctions( _db );
+	checkSchemaVersion();
 	if(!tableExists()) createTable();
+	else addMissingColumns( false );
+	createIndexes( false );
     }
-    int  getNumFields() { return _fieldmap.size();}
+    int  getNumFields() { return _fieldmap->size();}
     void clearTable();
     void finish();
+    void setBatchSize( int nrows );
+    int  getBatchSize() { return _batchsize; }
+    void setAsyncWrite( int nslots );
+    void setPrefetch( int nslots );
+    void setCommitPolicy( int nrows, size_t nbytes=0, int msec=0 );
+    void setStaticBinding( bool enable );
+    void setProjection( const std::vector<std::string> &fields );
+    void setLazy( const std::string &field, bool lazy=true );
+    void setDeferIndexes( bool defer ) { _defer_indexes = defer; }
+    void useStringArena( bool enable );
+    void clearStringArena();
     int  count(std::string where="");
+    int  count(std::string where, const QueryParams &params);
+    FieldStatistics stats( const std::string &field, std::string where="",
+			   const QueryParams &params=QueryParams() );
+    std::vector<long long> histogram( const std::string &field, int nbins,
+				      double lo, double hi,
+				      std::string where="",
+				      const QueryParams &params=QueryParams() );
+    void setStatementCacheSize( int n ) { _cache.setCapacity(n); }
+    bool getRowidRange( sqlite3_int64 &first, sqlite3_int64 &last );
+    const std::string &getTableName() { return _tablename; }
+    DatabaseRecordStats getStats();
+    void resetStats();
     std::ostream& print(std::ostream&);
     void zero();
 
     friend std::ostream& operator<<( std::ostream &stream,DatabaseRecord &rec );
+    friend class DatabaseJoin;
+    friend class ColumnSnapshot;
 
  protected:
     void setTableName(std::string name){_tablename=name;}
 
     void addField( std::string name, int &variable ) {
 	DatabaseField f;
-	f.ptr = (void*) &variable;
+	f.offset = (char*) &variable - (char*) this;
 	f.type = FIELD_INT;
 	f.primary_key = false;
-	_fieldmap[name] = f;
+	mutableFieldMap()[name] = f;
+	_codec = NULL;
     }
 
     void addField( std::string name, double &variable ) {
 	DatabaseField f;
-	f.ptr = (void*) &variable;
+	f.offset = (char*) &variable - (char*) this;
 	f.type = FIELD_DOUBLE;
 	f.primary_key = false;
-	_fieldmap[name] = f;
+	mutableFieldMap()[name] = f;
+	_codec = NULL;
+    }
+
+    // Compact types. sqlite stores integers in as few bytes as their
+    // values need (0 for 0/1 of a bool), so narrow fields take less
+    // space in the file; a float is stored as a double.
+
+    void addField( std::string name, int64_t &variable ) {
+	DatabaseField f;
+	f.offset = (char*) &variable - (char*) this;
+	f.type = FIELD_INT64;
+	mutableFieldMap()[name] = f;
+	_codec = NULL;
+    }
+    void addField( std::string name, float &variable ) {
+	DatabaseField f;
+	f.offset = (char*) &variable - (char*) this;
+	f.type = FIELD_FLOAT;
+	mutableFieldMap()[name] = f;
+	_codec = NULL;
+    }
+    void addField( std::string name, int16_t &variable ) {
+	DatabaseField f;
+	f.offset = (char*) &variable - (char*) this;
+	f.type = FIELD_INT16;
+	mutableFieldMap()[name] = f;
+	_codec = NULL;
+    }
+    void addField( std::string name, bool &variable ) {
+	DatabaseField f;
+	f.offset = (char*) &variable - (char*) this;
+	f.type = FIELD_BOOL;
+	mutableFieldMap()[name] = f;
+	_codec = NULL;
     }
     void addField( std::string name, std::string &variable ) {
 	DatabaseField f;
-	f.ptr = (void*) &variable;
+	f.offset = (char*) &variable - (char*) this;
 	f.type = FIELD_STRING;
 	f.primary_key = false;
-	_fieldmap[name] = f;
+	mutableFieldMap()[name] = f;
+	_codec = NULL;
+    }
+    void addField( std::string name, std::string_view &variable ) {
+	DatabaseField f;
+	f.offset = (char*) &variable - (char*) this;
+	f.type = FIELD_STRING_VIEW;
+	f.primary_key = false;
+	mutableFieldMap()[name] = f;
+	_codec = NULL;
+    }
+
+    /// map a fixed-size array, stored as one BLOB of all N elements
+    template <class T, std::size_t N>
+    void addField( std::string name, T (&array)[N] ) {
+	static_assert( std::is_trivially_copyable<T>::value,
+		       "addField(): array elements must be plain data" );
+	addBlob( name, array, sizeof(T), N, NULL );
     }
 
+    /// map the first count elements of an array, stored as one BLOB
+    template <class T, std::size_t N>
+    void addField( std::string name, T (&array)[N], int &count ) {
+	static_assert( std::is_trivially_copyable<T>::value,
+		       "addField(): array elements must be plain data" );
+	addBlob( name, array, sizeof(T), N, &count );
+    }
+
+    template <class Schema> void setFields( const Schema &fields );
+
+    void addIndex( const std::vector<std::string> &columns );
+
  private:
 
+    void addBlob( const std::string &name, void *array, size_t elemsize,
+		  size_t n, int *count );
     void createTable();
+    void addMissingColumns( bool required );
+    void createIndexes( bool required );
+    void dropIndexes();
+    std::string getIndexName( const std::vector<std::string> &columns );
     bool tableExists();
+    bool tableEmpty();
+    void checkSchemaVersion();
     std::string getSchema();
     std::string getFieldList();
+    std::string getFieldList( const std::vector<std::string> &fields );
+    std::string getQualifiedFieldList();
+    void fetchField( sqlite3_stmt *stmt, int i, const DatabaseField &field,
+		     DatabaseRecord &dest );
+    void fetchBlob( const DatabaseField &field, const void *data,
+		    size_t nbytes, DatabaseRecord &dest );
+    size_t blobBytes( const DatabaseField &field );
+    void updateProjection();
+    void closeBlobs();
+    void fetchFields( sqlite3_stmt *stmt, int first );
+    void fetchInto( DatabaseRecord &dest, sqlite3_stmt *stmt, int first );
+    void fetchRow( DatabaseRecord &dest, sqlite3_stmt *stmt );
+    std::string readSQL( const std::string &where_clause );
+    size_t readInto( const std::function<DatabaseRecord&()> &append,
+		     std::string where_clause, const QueryParams &params );
+
+    /// address of the variable mapped by field in this record
+    void *fieldPtr( const DatabaseField &field ) {
+	return (char*) this + field.offset;
+    }
+
+    /// the field map, unshared first if a copy shares it
+    std::map< std::string, DatabaseField > &mutableFieldMap() {
+	if (_fieldmap.use_count() > 1) 
+	    _fieldmap = std::make_shared< std::map<std::string,DatabaseField> >
+		( *_fieldmap );
+	return *_fieldmap;
+    }
     void prepareToWrite();
+    void prepareBatch();
+    void flushBatch();
+    void flushWrites();
+    void stepInsert( sqlite3_stmt *stmt );
+    void startWriter();
+    void stopWriter();
+    void drainQueue();
+    void startReader();
+    void stopReader();
+    void endRead();
+    void fillQueue();
+    int  readPrefetched();
+    void writeRow( DatabaseRow &row );
+    size_t bindFields( sqlite3_stmt *stmt, int first );
+    size_t bindRow( sqlite3_stmt *stmt, int first, const DatabaseRow &row );
+    void rowsWritten( int nrows, size_t nbytes );
+    void commit();
+    void beginTransaction();
+    void snapshot( DatabaseRow &row );
+    void registerStats();
+    void unregisterStats();
     
     database_t _db;
-    sqlite3_stmt *_rdstmt, *_wrstmt;
+    sqlite3_stmt *_rdstmt, *_wrstmt, *_batchstmt;
     std::string _tablename;
-    std::map< std::string, DatabaseField > _fieldmap;
+    /// shared by copies of the record, as the offsets are the same
+    std::shared_ptr< std::map< std::string, DatabaseField > > _fieldmap;
+    StatementCache _cache;	//!< prepared SELECT statements
+    std::string _rdsql;		//!< SQL of _rdstmt
+    std::vector<DatabaseField*> _projection; //!< fields read, or empty=all
+    std::vector<std::string> _projection_names;
+    std::vector<std::string> _projection_request; //!< see setProjection()
+    int _rowid_col;	       //!< column of the rowid, if lazy fields are left out
+    sqlite3_int64 _rdrowid;    //!< rowid of the current row (lazy fields)
+    std::map< std::string, sqlite3_blob* > _blobs; //!< open by readBlob()
 
     bool _write_in_progress;
     bool _read_in_progress;
     int _writecount;
-    int _badcount;
+
+    int _batchsize;	   //!< number of rows per multi-row INSERT
+    int _batchfill;	   //!< number of rows currently buffered
+    std::vector<DatabaseRow> _batch;
+
+    const FieldCodec *_codec;  //!< set by setFields(), or NULL
+    bool _use_codec;
+
+    int _commit_rows;	       //!< commit after this many rows (0=never)
+    size_t _commit_bytes;      //!< ... or this many bytes
+    int _commit_msec;	       //!< ... or this many milliseconds
+    int _pending_rows;	       //!< rows written since the last commit
+    size_t _pending_bytes;     //!< bytes written since the last commit
+    std::chrono::steady_clock::time_point _last_commit;
+
+    int _asyncslots;	       //!< size of the async write queue, or 0
+    RowQueue *_queue;	       //!< rows waiting for the writer thread
+    std::thread *_writer;      //!< writer thread in async mode
+
+    int _prefetchslots;	       //!< size of the prefetch queue, or 0
+    RowQueue *_rdqueue;	       //!< rows read ahead by the reader thread
+    std::thread *_reader;      //!< reader thread when prefetching
+    DatabaseRow *_rdrow;       //!< slot holding the current row
+    std::vector<DatabaseField*> _rdfields; //!< fields in _rdqueue's rows
+
+    StringArena *_arena;       //!< storage for string views, or NULL
+
+    std::vector< std::vector<std::string> > _indexes; //!< indexed columns
+    bool _defer_indexes;       //!< build indexes in finish()
+    bool _indexes_dropped;     //!< by prepareToWrite(), for finish() to build
+
+    // performance counters (times in ns), see getStats()
+    StatCounter _rows_written, _rows_read, _bytes_bound, _retries;
+    StatCounter _commits, _bind_ns, _step_ns, _reset_ns, _busy_ns;
+    StatCounter _commit_ns, _max_commit_ns;
+
+};
+
+
+/**
+ * Read all rows matching where_clause into a vector of records, e.g.
+ *
+ *	ParamRecord p;
+ *	p.setDatabaseHandle( db.getHandle() );
+ *	std::vector<ParamRecord> rows = p.readAll<ParamRecord>( "size>?", {100} );
+ *
+ * Record must be the class of this record. The vector is allocated
+ * once for the number of matching rows, and each row is decoded
+ * directly into its element, a copy of this record (so
+ * fields left out by setProjection() keep this record's values).  The
+ * elements are not connected to the database (see the copy
+ * constructor). std::string_view fields need useStringArena(), and
+ * then point into this record's arena.
+ */
+template <class Record>
+std::vector<Record> DatabaseRecord::readAll( std::string where_clause,
+					     const QueryParams &params ) {
+
+    static_assert( std::is_base_of<DatabaseRecord,Record>::value,
+		   "readAll(): Record must be a DatabaseRecord" );
+
+    Record &self = static_cast<Record&>(*this);
+    std::vector<Record> rows;
+
+    rows.reserve( count( where_clause, params ) );
+    readInto( [&rows,&self]() -> DatabaseRecord& {
+	    rows.push_back( self );
+	    return rows.back();
+	}, where_clause, params );
+    return rows;
+
+}
+
+
+/**
+ * Reads several records at once from one SELECT that joins their
+ * tables on common columns (by default event_number and telescope_id).
+ * Each call to readFromDatabase() fills all of the records with the
+ * next matching row.
+ */
+class DatabaseJoin {
+
+ public:
+
+    DatabaseJoin( const std::vector<DatabaseRecord*> &records,
+		  const std::vector<std::string> &using_columns
+		  = std::vector<std::string>{"event_number","telescope_id"} );
+    ~DatabaseJoin() { finish(); }
+
+    void prepareToRead( std::string where_clause="",
+			const QueryParams &params=QueryParams() );
+    int  readFromDatabase();
+    void finish();
+
+ private:
+
+    DatabaseJoin( const DatabaseJoin& );
+    DatabaseJoin &operator=( const DatabaseJoin& );
+
+    std::vector<DatabaseRecord*> _records;
+    std::vector<std::string> _using;
+    std::vector<int> _first;	//!< first column of each record
+    database_t _db;
+    sqlite3_stmt *_stmt;
 
 };
 
@@ -0,0 +1,150 @@
+//
+// Batch evaluation of energy-scaled (EZ) parameter cuts
+//
+
+#include <cmath>
+#include <sstream>
+#include <algorithm>
+#include "EZCuts.h"
+
+using namespace std;
+
+/// ezwidth fit values (490 pixel camera, no corrections)
+const ScaledParameterCoefficients EZWIDTH_COEFFICIENTS = {
+    0.003,			// a
+    0.04679,			// b
+    9.866,			// c
+    0.01534,			// e
+    0.00248,			// f
+    0.949,			// gamma
+    1.5				// cospow
+};
+
+/// rows per pass of the inner loops, small enough to stay in L1 cache
+static const size_t CHUNK = 256;
+
+
+/**
+ * Evaluate a scaled parameter (see ScaledParameterCoefficients) for n
+ * rows at once: result[i] is computed from param[i], size[i] and
+ * zenith[i]. 
+ *
+ * The work is done in short passes over each chunk of rows, so that
+ * the final pass is plain arithmetic on arrays that the compiler can
+ * vectorize. The zenith factor is only recomputed when the zenith
+ * angle changes, which is rare within a run.
+ */
+void scaledParameter( const double *param, const double *size,
+		      const double *zenith, double *result, size_t n,
+		      const ScaledParameterCoefficients &coeff ) {
+
+    const double cos60 = cos(60.0*M_PI/180.0);
+    const double norm = pow(cos60,coeff.gamma)/pow(cos60,coeff.cospow);
+    const double a = coeff.a, b = coeff.b, c = coeff.c;
+    const double e = coeff.e, f = coeff.f;
+
+    double zfactor[CHUNK], x[CHUNK];
+    double last_zenith = NAN, last_zfactor = 0;
+
+    for (size_t start=0; start<n; start += CHUNK) {
+
+	size_t m = min( CHUNK, n-start );
+	const double *par = param+start;
+	const double *siz = size+start;
+	const double *zen = zenith+start;
+	double *res = result+start;
+
+	for (size_t i=0; i<m; i++) {
+	    if (zen[i] != last_zenith) {
+		last_zenith = zen[i];
+		last_zfactor = norm/pow( cos(zen[i]), coeff.gamma );
+	    }
+	    zfactor[i] = last_zfactor;
+	}
+
+	// need to divide out .4489 since fit values assume 490 camera
+	// with no corrections
+	for (size_t i=0; i<m; i++) {
+	    x[i] = log( siz[i]/0.4489 );
+	}
+
+	for (size_t i=0; i<m; i++) {
+	    double shift2 = (par[i]*par[i] - a)*zfactor[i];
+	    double term1 = (shift2>1e-20) ? sqrt(shift2) : 1e-20;
+	    double d = x[i]-c;
+	    double r = term1 - d*(b + d*(e + d*f));
+	    double scaled2 = a + r*r;
+	    res[i] = (scaled2>0.0) ? sqrt(scaled2) : 0.0;
+	}
+
+    }
+
+}
+
+
+/**
+ * Compute the EZ parameters of all rows of p's table (matching
+ * where_clause) and write them with e, blocksize rows at a time. The
+ * input columns are read in bulk with readColumns(), and the
+ * parameters are evaluated with scaledParameter() over each block, so
+ * nothing is done per row except filling e.  Use e.setBatchSize()
+ * or e.setAsyncWrite() to speed up the writing as well.
+ *
+ * ezlength is only computed if coefficients for it are given
+ * (otherwise it is written as 0), and ezsize is the unscaled size.
+ *
+ * \returns the number of rows written
+ */
+int computeEZParams( ParamRecord &p, EZParamRecord &e,
+		     const ScaledParameterCoefficients *length_coeff,
+		     std::string where_clause, size_t blocksize ) {
+
+    sqlite3_int64 first, last;
+    vector<double> ezwidth, ezlength;
+    int nrows=0;
+
+    if (blocksize < 1) blocksize = 1;
+    if (p.getRowidRange( first, last ) == false) return 0;
+
+    for (sqlite3_int64 lo=first; lo<=last; lo += blocksize) {
+
+	ostringstream where;
+	where << "rowid BETWEEN " << lo << " AND " << lo+blocksize-1;
+	if (where_clause != "") where << " AND (" << where_clause << ")";
+
+	DatabaseColumns cols 
+	    = p.readColumns( {"event_number","telescope_id",
+			      "width","length","size","zenith"}, where.str() );
+	size_t n = cols.size();
+	if (n == 0) continue;
+
+	const vector<int> &event = cols.get<int>("event_number");
+	const vector<int> &tel = cols.get<int>("telescope_id");
+	const vector<double> &width = cols.get<double>("width");
+	const vector<double> &length = cols.get<double>("length");
+	const vector<double> &size = cols.get<double>("size");
+	const vector<double> &zenith = cols.get<double>("zenith");
+
+	ezwidth.resize(n);
+	ezlength.assign(n, 0.0);
+	scaledParameter( width.data(), size.data(), zenith.data(), 
+			 ezwidth.data(), n, EZWIDTH_COEFFICIENTS );
+	if (length_coeff) 
+	    scaledParameter( length.data(), size.data(), zenith.data(), 
+			     ezlength.data(), n, *length_coeff );
+
+	for (size_t i=0; i<n; i++) {
+	    e.event_number = event[i];
+	    e.telescope_id = tel[i];
+	    e.ezwidth = ezwidth[i];
+	    e.ezlength = ezlength[i];
+	    e.ezsize = size[i];
+	    e.writeToDatabase();
+	}
+	nrows += n;
+
+    }
+
+    return nrows;
+
+}
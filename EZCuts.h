@@ -0,0 +1,37 @@
+//
+// Batch evaluation of energy-scaled (EZ) parameter cuts
+//
+
+#ifndef EZCUTS_H
+#define EZCUTS_H
+
+#include <cstddef>
+#include <string>
+#include "DataTables.h"
+
+/**
+ * Coefficients of a size- and zenith-scaled image parameter, such as
+ * ezwidth. The scaled value of a parameter p is
+ *
+ *	sqrt( a + (sqrt(z*(p^2-a)) - b*d - e*d^2 - f*d^3)^2 )
+ *
+ * with d = ln(size/0.4489)-c, and zenith angle factor
+ * z = (cos(60)^gamma / cos(60)^cospow) / cos(zenith)^gamma.
+ */
+struct ScaledParameterCoefficients {
+    double a, b, c, e, f;
+    double gamma;
+    double cospow;
+};
+
+extern const ScaledParameterCoefficients EZWIDTH_COEFFICIENTS;
+
+void scaledParameter( const double *param, const double *size,
+		      const double *zenith, double *result, size_t n,
+		      const ScaledParameterCoefficients &coeff );
+
+int computeEZParams( ParamRecord &p, EZParamRecord &e,
+		     const ScaledParameterCoefficients *length_coeff=NULL,
+		     std::string where_clause="", size_t blocksize=65536 );
+
+#endif
@@ -0,0 +1,100 @@
+//
+// Parallel table scans for DatabaseRecord
+//
+
+#ifndef PARALLELREAD_H
+#define PARALLELREAD_H
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <thread>
+#include <exception>
+#include "DatabaseRecord.h"
+
+/**
+ * Read a whole table with several threads at once. The range of
+ * rowids in the table is split into nthreads equal parts, and each
+ * part is read by its own thread, with its own connection to the
+ * database file and its own instance of Record. For every row,
+ *
+ *	callback( Record &rec, int thread )
+ *
+ * is called from the thread that read it, with the row's values in
+ * rec. thread is the number (0..nthreads-1) of that thread, so the
+ * callback can fill per-thread buffers without locking. The rows are
+ * only ordered by rowid within one thread.
+ *
+ * where_clause may restrict the rows further (but must be a plain
+ * condition, without ORDER BY or LIMIT). The connections are opened
+ * with the given options (e.g. a large mmap_size speeds up scans of
+ * big files). Only data that has been committed to the file is seen.
+ * If any thread fails, the first error is rethrown after all threads
+ * have stopped.
+ *
+ * The connections are not read-only: like for any record,
+ * setDatabaseHandle() creates Record's table, missing columns and
+ * declared indexes if the file lacks them. This is done once, before
+ * the threads start, so they normally find nothing left to change.
+ * Another process changing the schema at the same time can still make
+ * a thread issue DDL, and wait for the write lock.
+ */
+template <class Record, class Callback>
+void parallelRead( const std::string &filename, int nthreads,
+		   Callback callback, std::string where_clause="",
+		   const DatabaseOptions &options=DatabaseOptions() ) {
+
+    sqlite3_int64 first, last;
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors;
+
+    if (nthreads < 1) nthreads = 1;
+
+    {
+	// also brings the schema up to date, for all threads
+	Database db( filename, options );
+	Record rec;
+	rec.setDatabaseHandle( db.getHandle() );
+	if (rec.getRowidRange( first, last ) == false) return;
+    }
+
+    sqlite3_int64 step = (last-first)/nthreads + 1;
+    errors.resize( nthreads );
+
+    for (int t=0; t<nthreads; t++) {
+
+	std::ostringstream range;
+	range << "rowid BETWEEN " << first+t*step
+	      << " AND " << first+(t+1)*step-1;
+	if (where_clause != "") range << " AND (" << where_clause << ")";
+	std::string where = range.str();
+
+	threads.push_back( std::thread( [&callback,&errors,&filename,&options,where,t]() {
+	    try {
+		Database db( filename, options );
+		Record rec;
+		rec.setDatabaseHandle( db.getHandle() );
+		rec.prepareToRead( where );
+		while (rec.readFromDatabase()) {
+		    callback( rec, t );
+		}
+		rec.finish();
+	    }
+	    catch (...) {
+		errors[t] = std::current_exception();
+	    }
+	} ) );
+
+    }
+
+    for (int t=0; t<nthreads; t++) {
+	threads[t].join();
+    }
+
+    for (int t=0; t<nthreads; t++) {
+	if (errors[t]) std::rethrow_exception( errors[t] );
+    }
+
+}
+
+#endif
@@ -0,0 +1,365 @@
+//
+// Compile-time field lists for DatabaseRecord
+//
+
+#ifndef RECORDSCHEMA_H
+#define RECORDSCHEMA_H
+
+#include <tuple>
+#include <utility>
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#include "DatabaseRecord.h"
+
+// Overloads used to bind/fetch a value of a given C++ type. These
+// are resolved at compile time, so no switch on DatabaseFieldType is
+// needed for records using a RecordSchema. bindValue() returns the
+// number of bytes bound.
+
+inline size_t bindValue( sqlite3_stmt *stmt, int i, int val ) {
+    sqlite3_bind_int( stmt, i, val );
+    return sizeof(val);
+}
+
+inline size_t bindValue( sqlite3_stmt *stmt, int i, double val ) {
+    sqlite3_bind_double( stmt, i, val );
+    return sizeof(val);
+}
+
+inline size_t bindValue( sqlite3_stmt *stmt, int i, int64_t val ) {
+    sqlite3_bind_int64( stmt, i, val );
+    return sizeof(val);
+}
+
+inline size_t bindValue( sqlite3_stmt *stmt, int i, float val ) {
+    sqlite3_bind_double( stmt, i, val );
+    return sizeof(val);
+}
+
+inline size_t bindValue( sqlite3_stmt *stmt, int i, int16_t val ) {
+    sqlite3_bind_int( stmt, i, val );
+    return sizeof(val);
+}
+
+inline size_t bindValue( sqlite3_stmt *stmt, int i, bool val ) {
+    sqlite3_bind_int( stmt, i, val );
+    return sizeof(val);
+}
+
+inline size_t bindValue( sqlite3_stmt *stmt, int i, const std::string &val ) {
+    sqlite3_bind_text( stmt, i, val.c_str(), val.length(), SQLITE_STATIC );
+    return val.length();
+}
+
+inline size_t bindValue( sqlite3_stmt *stmt, int i, std::string_view val ) {
+    sqlite3_bind_text( stmt, i, val.data(), val.length(), SQLITE_STATIC );
+    return val.length();
+}
+
+template <class T, std::size_t N>
+inline size_t bindValue( sqlite3_stmt *stmt, int i, const T (&val)[N],
+			 int count=N ) {
+    size_t n = (count <= 0) ? 0 : std::min( (size_t) count, N )*sizeof(T);
+    sqlite3_bind_blob( stmt, i, val, n, SQLITE_STATIC );
+    return n;
+}
+
+inline void fetchValue( sqlite3_stmt *stmt, int col, int &val ) {
+    val = sqlite3_column_int( stmt, col );
+}
+
+inline void fetchValue( sqlite3_stmt *stmt, int col, double &val ) {
+    val = sqlite3_column_double( stmt, col );
+}
+
+inline void fetchValue( sqlite3_stmt *stmt, int col, int64_t &val ) {
+    val = sqlite3_column_int64( stmt, col );
+}
+
+inline void fetchValue( sqlite3_stmt *stmt, int col, float &val ) {
+    val = sqlite3_column_double( stmt, col );
+}
+
+inline void fetchValue( sqlite3_stmt *stmt, int col, int16_t &val ) {
+    val = sqlite3_column_int( stmt, col );
+}
+
+inline void fetchValue( sqlite3_stmt *stmt, int col, bool &val ) {
+    val = sqlite3_column_int( stmt, col );
+}
+
+inline void fetchValue( sqlite3_stmt *stmt, int col, std::string &val ) {
+    const char *text = (const char*) sqlite3_column_text( stmt, col );
+    if (text) val.assign( text, sqlite3_column_bytes( stmt, col ) );
+    else val.clear();
+}
+
+inline void fetchValue( sqlite3_stmt *stmt, int col, std::string_view &val ) {
+    const char *text = (const char*) sqlite3_column_text( stmt, col );
+    if (text) val = std::string_view( text, sqlite3_column_bytes( stmt, col ) );
+    else val = std::string_view();
+}
+
+/// \returns the number of elements read; the rest are left alone
+template <class T, std::size_t N>
+inline int fetchValue( sqlite3_stmt *stmt, int col, T (&val)[N] ) {
+    const void *blob = sqlite3_column_blob( stmt, col );
+    size_t n = std::min( (size_t) sqlite3_column_bytes( stmt, col ), sizeof(val) );
+    if (blob && n) memcpy( val, blob, n );
+    return blob ? n/sizeof(T) : 0;
+}
+
+template <class T> inline void zeroValue( T &val ) { val = {}; }
+
+template <class T, std::size_t N>
+inline void zeroValue( T (&val)[N] ) { memset( val, 0, sizeof(val) ); }
+
+
+/**
+ * A field which is a direct member of the record,
+ * e.g. field("size",&ParamRecord::size)
+ */
+template <class Record, class T>
+struct MemberField {
+    typedef Record record_type;
+    const char *name;
+    T Record::*member;
+    T &get( Record &rec ) const { return rec.*member; }
+};
+
+/**
+ * A field which is a member of a struct member of the record,
+ * e.g. field("centroid_x", &ParamRecord::centroid, &Coordinate_t::x)
+ */
+template <class Record, class S, class T>
+struct NestedField {
+    typedef Record record_type;
+    const char *name;
+    S Record::*outer;
+    T S::*inner;
+    T &get( Record &rec ) const { return (rec.*outer).*inner; }
+};
+
+/**
+ * A field which is one element of an array member of the record,
+ * e.g. field("max1", &ParamRecord::max, 0)
+ */
+template <class Record, class T, std::size_t N>
+struct ArrayField {
+    typedef Record record_type;
+    const char *name;
+    T (Record::*array)[N];
+    std::size_t index;
+    T &get( Record &rec ) const { return (rec.*array)[index]; }
+};
+
+/**
+ * An array member of the record of which only the first count
+ * elements are used, stored as one BLOB, e.g.
+ * field("plot", &MuonRecord::plot, &MuonRecord::nplotpoints)
+ */
+template <class Record, class T, std::size_t N>
+struct CountedArrayField {
+    typedef Record record_type;
+    const char *name;
+    T (Record::*array)[N];
+    int Record::*count;
+    T (&get( Record &rec ) const)[N] { return rec.*array; }
+};
+
+template <class F> struct IsCountedArray : std::false_type {};
+template <class Record, class T, std::size_t N>
+struct IsCountedArray< CountedArrayField<Record,T,N> > : std::true_type {};
+
+template <class Record, class T>
+constexpr MemberField<Record,T>
+field( const char *name, T Record::*member ) {
+    return MemberField<Record,T>{ name, member };
+}
+
+template <class Record, class S, class T>
+constexpr NestedField<Record,S,T>
+field( const char *name, S Record::*outer, T S::*inner ) {
+    return NestedField<Record,S,T>{ name, outer, inner };
+}
+
+template <class Record, class T, std::size_t N>
+constexpr ArrayField<Record,T,N>
+field( const char *name, T (Record::*array)[N], std::size_t index ) {
+    return ArrayField<Record,T,N>{ name, array, index };
+}
+
+template <class Record, class T, std::size_t N, class C>
+constexpr CountedArrayField<Record,T,N>
+field( const char *name, T (Record::*array)[N], C Record::*count ) {
+    return CountedArrayField<Record,T,N>{ name, array, count };
+}
+
+
+/**
+ * A list of fields of a DatabaseRecord subclass whose types are
+ * known at compile time. Passing one to DatabaseRecord::setFields()
+ * in the record's constructor maps all of the fields (just like
+ * calling addField() for each), and lets the record bind, read and
+ * zero them with straight-line code generated for that record type
+ * instead of walking the field map.  Build one with schema():
+ *
+ *	setFields( schema( field("i", &TestRecord::i),
+ *			   field("x", &TestRecord::x) ) );
+ */
+template <class Record, class... Fields>
+class RecordSchema : public FieldCodec {
+
+ public:
+
+    typedef Record record_type;
+    static const std::size_t size = sizeof...(Fields);
+
+    RecordSchema( Fields... f ) : _fields(f...) {
+	for (std::size_t i=0; i<size; i++) _column[i] = i;
+    }
+
+    const std::tuple<Fields...> &fields() const { return _fields; }
+
+    /**
+     * Set the column number of each field (relative to the first
+     * column) to its position in the given field map, which is the
+     * order used in the SQL generated by DatabaseRecord.
+     */
+    void setColumns( const std::map<std::string,DatabaseField> &fieldmap ) {
+	setColumns( fieldmap, std::index_sequence_for<Fields...>() );
+    }
+
+    size_t bind( DatabaseRecord &rec, sqlite3_stmt *stmt, int first ) const {
+	return bindAll( static_cast<Record&>(rec), stmt, first,
+		 std::index_sequence_for<Fields...>() );
+    }
+
+    void fetch( DatabaseRecord &rec, sqlite3_stmt *stmt, int first ) const {
+	fetchAll( static_cast<Record&>(rec), stmt, first,
+		  std::index_sequence_for<Fields...>() );
+    }
+
+    void zero( DatabaseRecord &rec ) const {
+	zeroAll( static_cast<Record&>(rec),
+		 std::index_sequence_for<Fields...>() );
+    }
+
+ private:
+
+    template <std::size_t... I>
+    void setColumns( const std::map<std::string,DatabaseField> &fieldmap,
+		     std::index_sequence<I...> ) {
+	const char *names[] = { std::get<I>(_fields).name... };
+	for (std::size_t i=0; i<size; i++) {
+	    std::map<std::string,DatabaseField>::const_iterator it;
+	    it = fieldmap.find( names[i] );
+	    if (it == fieldmap.end())
+		throw std::runtime_error( std::string("RecordSchema: no field '")
+					  +names[i]+"'" );
+	    _column[i] = std::distance( fieldmap.begin(), it );
+	}
+    }
+
+    template <std::size_t... I>
+    size_t bindAll( Record &rec, sqlite3_stmt *stmt, int first,
+		    std::index_sequence<I...> ) const {
+	return (size_t(0) + ... + 
+		bindField( stmt, first+_column[I], std::get<I>(_fields), rec ));
+    }
+
+    template <std::size_t... I>
+    void fetchAll( Record &rec, sqlite3_stmt *stmt, int first,
+		   std::index_sequence<I...> ) const {
+	(fetchField( stmt, first+_column[I], std::get<I>(_fields), rec ), ...);
+    }
+
+    template <std::size_t... I>
+    void zeroAll( Record &rec, std::index_sequence<I...> ) const {
+	(zeroField( std::get<I>(_fields), rec ), ...);
+    }
+
+    // counted arrays need their count as well as the array
+
+    template <class F>
+    static size_t bindField( sqlite3_stmt *stmt, int i, const F &f, 
+			     Record &rec ) {
+	if constexpr (IsCountedArray<F>::value)
+	    return bindValue( stmt, i, f.get(rec), rec.*f.count );
+	else
+	    return bindValue( stmt, i, f.get(rec) );
+    }
+
+    template <class F>
+    static void fetchField( sqlite3_stmt *stmt, int col, const F &f, 
+			    Record &rec ) {
+	if constexpr (IsCountedArray<F>::value)
+	    rec.*f.count = fetchValue( stmt, col, f.get(rec) );
+	else if constexpr (std::is_array<std::remove_reference_t<
+			       decltype(f.get(rec))>>::value) {
+	    // a whole fixed array: clear what the blob didn't cover
+	    auto &val = f.get(rec);
+	    int n = fetchValue( stmt, col, val );
+	    memset( (char*) (val+n), 0, sizeof(val)-n*sizeof(val[0]) );
+	}
+	else
+	    fetchValue( stmt, col, f.get(rec) );
+    }
+
+    template <class F>
+    static void zeroField( const F &f, Record &rec ) {
+	if constexpr (IsCountedArray<F>::value)
+	    rec.*f.count = 0;
+	else
+	    zeroValue( f.get(rec) );
+    }
+
+    std::tuple<Fields...> _fields;
+    int _column[sizeof...(Fields)];
+
+};
+
+
+template <class F, class... Fs>
+RecordSchema<typename F::record_type, F, Fs...> schema( F f, Fs... fs ) {
+    return RecordSchema<typename F::record_type, F, Fs...>( f, fs... );
+}
+
+
+/**
+ * Map all fields of a RecordSchema (see RecordSchema.h). The fields
+ * are added to the field map as with addField(), so everything that
+ * works on the field map keeps working. If the schema covers all
+ * mapped fields of the record, reads, writes and zero() use the
+ * schema's generated code rather than the field map.
+ */
+template <class Schema>
+void DatabaseRecord::setFields( const Schema &fields ) {
+
+    typedef typename Schema::record_type Record;
+    Record &rec = static_cast<Record&>(*this);
+
+    auto map = [&]( const auto &f ) {
+	if constexpr (IsCountedArray< std::decay_t<decltype(f)> >::value)
+	    addField( f.name, f.get(rec), rec.*f.count );
+	else
+	    addField( f.name, f.get(rec) );
+    };
+    std::apply( [&]( const auto&... f ) { (map(f), ...); }, fields.fields() );
+
+    if (_fieldmap->size() != Schema::size) return;
+
+    // the field names and so the column order are the same for every
+    // instance of Record, so only one compiled schema is needed.
+    static const Schema compiled = [&]() {
+	Schema s(fields);
+	s.setColumns(*_fieldmap);
+	return s;
+    }();
+
+    _codec = &compiled;
+
+}
+
+#endif
@@ -0,0 +1,83 @@
+//
+// Lock-free queue of row snapshots for DatabaseRecord
+//
+
+#ifndef ROWQUEUE_H
+#define ROWQUEUE_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include "DatabaseRecord.h"
+
+/**
+ * A fixed-size ring of preallocated DatabaseRow slots, shared by
+ * exactly one producer thread and one consumer thread. Neither side
+ * ever blocks or locks: back() and front() return NULL when the ring
+ * is full or empty, and the caller decides how to wait.
+ *
+ * The producer fills the slot returned by back() and then calls
+ * push(); the consumer uses the slot returned by front() and then
+ * calls pop().  The producer calls close() when it has no more rows,
+ * and either side can call fail() to tell the other to give up.
+ */
+class RowQueue {
+
+ public:
+
+    RowQueue( size_t nslots, size_t nfields )
+	: _slots(nslots, DatabaseRow(nfields)), _head(0), _tail(0),
+	  _closed(false), _failed(false) {;}
+
+    /// \returns the slot to fill next, or NULL if the ring is full
+    DatabaseRow *back() {
+	size_t head = _head.load( std::memory_order_relaxed );
+	if (head - _tail.load( std::memory_order_acquire ) == _slots.size())
+	    return NULL;
+	return &_slots[ head % _slots.size() ];
+    }
+
+    /// make the slot returned by back() visible to the consumer
+    void push() {
+	_head.store( _head.load(std::memory_order_relaxed)+1,
+		     std::memory_order_release );
+    }
+
+    /// \returns the oldest filled slot, or NULL if the ring is empty
+    DatabaseRow *front() {
+	size_t tail = _tail.load( std::memory_order_relaxed );
+	if (tail == _head.load( std::memory_order_acquire ))
+	    return NULL;
+	return &_slots[ tail % _slots.size() ];
+    }
+
+    /// give the slot returned by front() back to the producer
+    void pop() {
+	_tail.store( _tail.load(std::memory_order_relaxed)+1,
+		     std::memory_order_release );
+    }
+
+    size_t capacity() const { return _slots.size(); }
+
+    void close() { _closed.store( true, std::memory_order_release ); }
+    bool closed() const { return _closed.load( std::memory_order_acquire ); }
+
+    void fail( const std::string &msg ) {
+	_error = msg;
+	_failed.store( true, std::memory_order_release );
+    }
+    bool failed() const { return _failed.load( std::memory_order_acquire ); }
+    const std::string &error() const { return _error; }
+
+ private:
+
+    std::vector<DatabaseRow> _slots;
+    alignas(64) std::atomic<size_t> _head;  //!< count of pushed rows
+    alignas(64) std::atomic<size_t> _tail;  //!< count of popped rows
+    std::atomic<bool> _closed;
+    std::atomic<bool> _failed;
+    std::string _error;
+
+};
+
+#endif
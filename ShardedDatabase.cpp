@@ -0,0 +1,403 @@
+//
+// Sharded ingest of DatabaseRecord tables
+//
+
+#include <sstream>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+#include <unistd.h>
+#include "ShardedDatabase.h"
+
+using namespace std;
+
+/**
+ * What merge() needs to know about one table: its definition, the
+ * definitions of its indexes and which shards have it.
+ */
+struct ShardedTable {
+    string name;
+    string sql;
+    vector<string> indexes;
+    vector<int> shards;
+};
+
+
+/**
+ * Execute one or more SQL statements, throwing on failure
+ */
+static void execSQL( database_t db, const string &sql ) {
+
+    char *err = NULL;
+    if (sqlite3_exec( db, sql.c_str(), NULL, NULL, &err ) != SQLITE_OK) {
+	string msg = err ? err : sqlite3_errmsg(db);
+	sqlite3_free( err );
+	throw runtime_error("ShardedDatabase: "+msg+" in: "+sql);
+    }
+
+}
+
+
+/**
+ * ATTACH the given file to db as the schema named alias. The file
+ * name is bound, so it needs no quoting.
+ */
+static void attach( database_t db, const string &filename,
+		    const string &alias ) {
+
+    sqlite3_stmt *stmt;
+    string sql = "ATTACH ? AS "+alias;
+    if (sqlite3_prepare_v2( db, sql.c_str(), -1, &stmt, NULL ) != SQLITE_OK)
+	throw runtime_error("ShardedDatabase: "+string(sqlite3_errmsg(db)));
+    sqlite3_bind_text( stmt, 1, filename.c_str(), -1, SQLITE_TRANSIENT );
+    int ret = sqlite3_step( stmt );
+    sqlite3_finalize( stmt );
+    if (ret != SQLITE_DONE)
+	throw runtime_error("ShardedDatabase: can't attach '"+filename+"': "
+			    +sqlite3_errmsg(db));
+
+}
+
+
+/**
+ * Remove a database file and its journal files
+ */
+static void removeFiles( const string &filename ) {
+    unlink( filename.c_str() );
+    unlink( (filename+"-journal").c_str() );
+    unlink( (filename+"-wal").c_str() );
+    unlink( (filename+"-shm").c_str() );
+}
+
+
+/**
+ * Create a table in db and fill it with the rows of all shards that
+ * have it, then build its indexes (once, after all rows are in).
+ */
+static void collectTable( database_t db, const ShardedTable &tab,
+			  const ShardedDatabase &shards ) {
+
+    execSQL( db, tab.sql );
+    for (size_t s=0; s<tab.shards.size(); s++) {
+	attach( db, shards.getShardFilename(tab.shards[s]), "shard" );
+	execSQL( db, "INSERT INTO main."+tab.name
+		 +" SELECT * FROM shard."+tab.name );
+	execSQL( db, "DETACH shard" );
+    }
+    for (size_t j=0; j<tab.indexes.size(); j++)
+	execSQL( db, tab.indexes[j] );
+
+}
+
+
+/**
+ * \returns the name under which shard i of a table is attached by
+ * replaceTable()
+ */
+static string shardAlias( size_t i ) {
+    ostringstream alias;
+    alias << "shard" << i;
+    return alias.str();
+}
+
+
+/**
+ * Replace a table of db by the rows of all shards that have it, like
+ * collectTable(), but in one transaction, so that the old table is
+ * kept if anything fails. The shards are all attached first, since a
+ * database can't be detached while the transaction uses it, and
+ * detached again at the end (also on errors).
+ *
+ * \returns the number of rows collected
+ */
+static size_t replaceTable( database_t db, const ShardedTable &tab,
+			    const ShardedDatabase &shards ) {
+
+    size_t nattached = 0, nrows = 0;
+
+    try {
+	for (size_t s=0; s<tab.shards.size(); s++) {
+	    attach( db, shards.getShardFilename(tab.shards[s]), 
+		    shardAlias(s) );
+	    nattached++;
+	}
+	execSQL( db, "BEGIN IMMEDIATE" );
+	execSQL( db, "DROP TABLE IF EXISTS main."+tab.name );
+	execSQL( db, tab.sql );
+	for (size_t s=0; s<tab.shards.size(); s++) {
+	    execSQL( db, "INSERT INTO main."+tab.name
+		     +" SELECT * FROM "+shardAlias(s)+"."+tab.name );
+	    nrows += sqlite3_changes( db );
+	}
+	for (size_t j=0; j<tab.indexes.size(); j++)
+	    execSQL( db, tab.indexes[j] );
+	execSQL( db, "COMMIT" );
+    }
+    catch (...) {
+	if (sqlite3_get_autocommit( db ) == 0)
+	    sqlite3_exec( db, "ROLLBACK", NULL, NULL, NULL );
+	for (size_t s=0; s<nattached; s++)
+	    sqlite3_exec( db, ("DETACH "+shardAlias(s)).c_str(), 
+			  NULL, NULL, NULL );
+	throw;
+    }
+
+    for (size_t s=0; s<nattached; s++)
+	execSQL( db, "DETACH "+shardAlias(s) );
+    return nrows;
+
+}
+
+
+/**
+ * Create the shard files, replacing any that exist. Each shard is
+ * opened with the given options.
+ */
+ShardedDatabase::ShardedDatabase( const std::string &filename, int nshards,
+				  const DatabaseOptions &options )
+    : _filename(filename), _options(options) {
+
+    if (nshards < 1)
+	throw runtime_error("ShardedDatabase: need at least one shard");
+
+    try {
+	for (int i=0; i<nshards; i++) {
+	    removeFiles( getShardFilename(i) );
+	    _shards.push_back( new Database( getShardFilename(i), options ) );
+	}
+    }
+    catch (runtime_error &e) {
+	for (size_t i=0; i<_shards.size(); i++) delete _shards[i];
+	throw;
+    }
+
+}
+
+
+/**
+ * Close the shards. The shard files are kept unless removeShards()
+ * was called.
+ */
+ShardedDatabase::~ShardedDatabase() {
+
+    for (size_t i=0; i<_shards.size(); i++) delete _shards[i];
+
+}
+
+
+std::string
+ShardedDatabase::getShardFilename( int i ) const {
+
+    ostringstream name;
+    name << _filename << ".shard" << i;
+    return name.str();
+
+}
+
+
+/**
+ * Set the durability profile of all shards (see
+ * Database::setDurability()). Shards can be re-created from the raw
+ * data if the ingest fails, so DURABILITY_BULK_LOAD is usually right.
+ */
+void
+ShardedDatabase::setDurability( DurabilityProfile profile ) {
+
+    for (size_t i=0; i<_shards.size(); i++)
+	_shards[i]->setDurability( profile );
+
+}
+
+
+/**
+ * Combine the shards into the output file. Any table of that name
+ * already in the output file is replaced; other tables are left
+ * alone. Records writing to the shards must be finish()ed first,
+ * since only committed rows are merged. A table in several shards
+ * gets the rows of shard 0 first, then those of shard 1 and so on,
+ * with new rowids. All shards must define a table the same way.
+ *
+ * With more than one thread (default: one per core), the tables are
+ * merged in two steps:
+ *
+ * - each table is collected from the shards with INSERT...SELECT into
+ *   a staging file of its own ("<filename>.<table>.merge"), and its
+ *   indexes are built there. Up to nthreads tables are done at once,
+ *   since they are separate files.
+ *
+ * - the staging files are attached to the output file one after
+ *   the other, and their tables copied in. The table and its indexes
+ *   are defined the same in both, so sqlite copies the finished
+ *   b-trees rather than re-inserting and re-sorting.
+ *
+ * With one thread, or only one table, the tables are collected in
+ * the output file directly, which saves the copy. Each table is then
+ * replaced in one transaction, with all its shards attached at once
+ * (so this needs no more shards than sqlite may attach, see
+ * SQLITE_LIMIT_ATTACHED; otherwise the staging files are used).
+ * Either way, a table of the output file is only replaced once its
+ * new contents are complete. The output file is written without
+ * syncing to disk, as the shards are still there to merge again if
+ * the system crashes.
+ *
+ * \returns the number of rows merged
+ */
+size_t
+ShardedDatabase::merge( int nthreads ) {
+
+    vector<ShardedTable> tables;
+    map<string,size_t> table_index;
+
+    // collect the tables and index definitions of all shards
+
+    for (size_t s=0; s<_shards.size(); s++) {
+	sqlite3_stmt *stmt;
+	database_t db = _shards[s]->getHandle();
+	const char *sql =
+	    "SELECT type, name, tbl_name, sql FROM sqlite_master "
+	    "WHERE sql NOT NULL AND name NOT LIKE 'sqlite_%' "
+	    "ORDER BY type='index'";
+	if (sqlite3_prepare_v2( db, sql, -1, &stmt, NULL ) != SQLITE_OK)
+	    throw runtime_error("ShardedDatabase::merge(): "
+				+string(sqlite3_errmsg(db)));
+
+	while (sqlite3_step( stmt ) == SQLITE_ROW) {
+	    string type = (const char*) sqlite3_column_text( stmt, 0 );
+	    string name = (const char*) sqlite3_column_text( stmt, 1 );
+	    string tbl = (const char*) sqlite3_column_text( stmt, 2 );
+	    string def = (const char*) sqlite3_column_text( stmt, 3 );
+
+	    if (type == "table") {
+		if (table_index.find(name) == table_index.end()) {
+		    table_index[name] = tables.size();
+		    tables.push_back( ShardedTable() );
+		    tables.back().name = name;
+		    tables.back().sql = def;
+		}
+		ShardedTable &t = tables[ table_index[name] ];
+		if (t.sql != def) {
+		    sqlite3_finalize( stmt );
+		    throw runtime_error("ShardedDatabase::merge(): table '"+name
+					+"' differs between shards");
+		}
+		t.shards.push_back( s );
+	    }
+	    else if (type == "index" && table_index.find(tbl) != table_index.end()) {
+		ShardedTable &t = tables[ table_index[tbl] ];
+		if (t.shards[0] == (int)s)	// from the first shard only
+		    t.indexes.push_back( def );
+	    }
+	}
+	sqlite3_finalize( stmt );
+    }
+
+    if (tables.empty()) return 0;
+
+    if (nthreads < 1) nthreads = std::thread::hardware_concurrency();
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > (int)tables.size()) nthreads = tables.size();
+
+    size_t nrows = 0;
+    Database out( _filename, _options );
+    database_t db = out.getHandle();
+    execSQL( db, "PRAGMA synchronous=OFF" );
+
+    size_t maxshards = 0;
+    for (size_t i=0; i<tables.size(); i++)
+	maxshards = std::max( maxshards, tables[i].shards.size() );
+    if ((int)maxshards > sqlite3_limit( db, SQLITE_LIMIT_ATTACHED, -1 ))
+	sqlite3_limit( db, SQLITE_LIMIT_ATTACHED, maxshards );	// if allowed
+
+    if (nthreads == 1 
+	&& (int)maxshards <= sqlite3_limit( db, SQLITE_LIMIT_ATTACHED, -1 )) {
+	for (size_t i=0; i<tables.size(); i++)
+	    nrows += replaceTable( db, tables[i], *this );
+	return nrows;
+    }
+
+    // build each table in its own staging file, several at once
+
+    vector<string> staging( tables.size() );
+    vector<std::thread> threads;
+    vector<std::exception_ptr> errors( nthreads );
+    std::atomic<size_t> next(0);
+
+    for (size_t i=0; i<tables.size(); i++)
+	staging[i] = _filename+"."+tables[i].name+".merge";
+
+    for (int t=0; t<nthreads; t++) {
+
+	threads.push_back( std::thread( [this,&tables,&staging,&errors,&next,t]() {
+	    try {
+		size_t i;
+		while ((i = next++) < tables.size()) {
+		    removeFiles( staging[i] );
+		    Database tmp( staging[i], _options );
+		    tmp.setDurability( DURABILITY_IN_MEMORY );
+		    collectTable( tmp.getHandle(), tables[i], *this );
+		}
+	    }
+	    catch (...) {
+		errors[t] = std::current_exception();
+	    }
+	} ) );
+
+    }
+
+    for (int t=0; t<nthreads; t++) {
+	threads[t].join();
+    }
+
+    // copy the finished tables into the output file
+
+    try {
+	for (int t=0; t<nthreads; t++) {
+	    if (errors[t]) std::rethrow_exception( errors[t] );
+	}
+
+	for (size_t i=0; i<tables.size(); i++) {
+	    const ShardedTable &tab = tables[i];
+
+	    attach( db, staging[i], "merged" );
+	    execSQL( db, "BEGIN IMMEDIATE" );
+	    execSQL( db, "DROP TABLE IF EXISTS main."+tab.name );
+	    execSQL( db, tab.sql );
+	    for (size_t j=0; j<tab.indexes.size(); j++)
+		execSQL( db, tab.indexes[j] );
+	    execSQL( db, "INSERT INTO main."+tab.name
+		     +" SELECT * FROM merged."+tab.name );
+	    nrows += sqlite3_changes( db );
+	    execSQL( db, "COMMIT" );
+	    execSQL( db, "DETACH merged" );
+	    removeFiles( staging[i] );
+	}
+    }
+    catch (...) {
+	if (sqlite3_get_autocommit( db ) == 0)
+	    sqlite3_exec( db, "ROLLBACK", NULL, NULL, NULL );
+	sqlite3_exec( db, "DETACH merged", NULL, NULL, NULL );
+	for (size_t i=0; i<tables.size(); i++) removeFiles( staging[i] );
+	throw;
+    }
+
+    return nrows;
+
+}
+
+
+/**
+ * Close the shards and delete their files. Records that were using
+ * them must not be used afterwards.
+ */
+void
+ShardedDatabase::removeShards() {
+
+    for (size_t i=0; i<_shards.size(); i++) {
+	delete _shards[i];
+	removeFiles( getShardFilename(i) );
+    }
+    _shards.clear();
+
+}
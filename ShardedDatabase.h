@@ -0,0 +1,63 @@
+//
+// Sharded ingest of DatabaseRecord tables
+//
+
+#ifndef SHARDEDDATABASE_H
+#define SHARDEDDATABASE_H
+
+#include <string>
+#include <vector>
+#include "DatabaseRecord.h"
+
+/**
+ * A database that is written as several shard files, which are merged
+ * into one file at the end. sqlite lets only one connection write to
+ * a file at a time, so writers sharing one file (e.g. one per
+ * telescope) take turns; with a shard each, they don't wait for each
+ * other at all. Each shard is an ordinary Database, so the same
+ * DatabaseRecord subclasses write to it:
+ *
+ *	ShardedDatabase run( "run.db", 4 );
+ *	// in thread/process t:
+ *	ParamRecord p;
+ *	p.setDatabaseHandle( run.shard(t).getHandle() );
+ *	... p.writeToDatabase() ...
+ *	p.finish();
+ *	// after all writers are finished:
+ *	run.merge();
+ *	run.removeShards();
+ *
+ * merge() builds each table from all shards that have it, working on
+ * several tables at once, and then assembles the tables in the output
+ * file. Shard i is stored in "<filename>.shard<i>"; existing shard
+ * files are replaced.
+ */
+class ShardedDatabase {
+
+ public:
+
+    ShardedDatabase( const std::string &filename, int nshards,
+		     const DatabaseOptions &options=DatabaseOptions() );
+    ~ShardedDatabase();
+
+    int getNumShards() const { return _shards.size(); }
+    Database &shard( int i ) { return *_shards.at(i); }
+    const std::string &getFilename() const { return _filename; }
+    std::string getShardFilename( int i ) const;
+    void setDurability( DurabilityProfile profile );
+
+    size_t merge( int nthreads=0 );
+    void removeShards();
+
+ private:
+
+    ShardedDatabase( const ShardedDatabase& );
+    ShardedDatabase &operator=( const ShardedDatabase& );
+
+    std::string _filename;
+    DatabaseOptions _options;
+    std::vector<Database*> _shards;
+
+};
+
+#endif
@@ -0,0 +1,272 @@
+//
+// Fast text export of database tables
+//
+
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include "TableDump.h"
+
+using namespace std;
+
+/**
+ * Output buffer that is written out in large blocks, so the cost of
+ * the underlying write is paid once per block rather than per line.
+ */
+class DumpBuffer {
+
+ public:
+
+    DumpBuffer( FILE *out, size_t size=1<<20 )
+	: _out(out), _buf(size), _fill(0), _total(0) {;}
+
+    /// make sure n more bytes fit, and return where to put them
+    char *reserve( size_t n ) {
+	if (_fill+n > _buf.size()) {
+	    flush();
+	    if (n > _buf.size()) _buf.resize(n);
+	}
+	return &_buf[_fill];
+    }
+    void commit( size_t n ) { _fill += n; }
+
+    void put( char c ) { *reserve(1) = c; _fill++; }
+    void put( const char *s, size_t n ) { 
+	memcpy( reserve(n), s, n ); 
+	_fill += n; 
+    }
+
+    void flush() {
+	if (_fill && fwrite( &_buf[0], 1, _fill, _out ) != _fill)
+	    throw runtime_error("dumpTable(): write error");
+	_total += _fill;
+	_fill = 0;
+    }
+
+    size_t total() const { return _total+_fill; }
+
+ private:
+
+    FILE *_out;
+    vector<char> _buf;
+    size_t _fill;
+    size_t _total;
+
+};
+
+
+static void putInt( DumpBuffer &buf, sqlite3_int64 val ) {
+    char *p = buf.reserve(24);
+    buf.commit( to_chars( p, p+24, val ).ptr - p );
+}
+
+/// shortest text that reads back as the same double
+static void putDouble( DumpBuffer &buf, double val ) {
+    char *p = buf.reserve(32);
+    buf.commit( to_chars( p, p+32, val ).ptr - p );
+}
+
+static void putText( DumpBuffer &buf, DumpFormat format, 
+		     const char *s, size_t n ) {
+
+    size_t i;
+
+    switch (format) {
+
+    case DUMP_CSV:
+	// quote only if needed, doubling quotes inside (RFC 4180)
+	for (i=0; i<n; i++) {
+	    if (s[i]==',' || s[i]=='"' || s[i]=='\r' || s[i]=='\n') break;
+	}
+	if (i == n) {
+	    buf.put( s, n );
+	    return;
+	}
+	buf.put('"');
+	for (i=0; i<n; i++) {
+	    if (s[i]=='"') buf.put('"');
+	    buf.put(s[i]);
+	}
+	buf.put('"');
+	break;
+
+    case DUMP_TSV:
+	for (i=0; i<n; i++) {
+	    switch (s[i]) {
+	    case '\t': buf.put("\\t",2); break;
+	    case '\n': buf.put("\\n",2); break;
+	    case '\r': buf.put("\\r",2); break;
+	    case '\\': buf.put("\\\\",2); break;
+	    default: buf.put(s[i]);
+	    }
+	}
+	break;
+
+    case DUMP_JSONL:
+	buf.put('"');
+	for (i=0; i<n; i++) {
+	    unsigned char c = s[i];
+	    if (c=='"' || c=='\\') {
+		buf.put('\\');
+		buf.put(c);
+	    }
+	    else if (c < 0x20) {
+		char esc[8];
+		snprintf( esc, sizeof(esc), "\\u%04x", c );
+		buf.put( esc, 6 );
+	    }
+	    else buf.put(c);
+	}
+	buf.put('"');
+	break;
+
+    }
+
+}
+
+
+/// blobs as hexadecimal digits, like sqlite's hex()
+static void putHex( DumpBuffer &buf, DumpFormat format,
+		    const unsigned char *s, size_t n ) {
+
+    static const char digits[] = "0123456789ABCDEF";
+
+    if (format == DUMP_JSONL) buf.put('"');
+    char *p = buf.reserve( 2*n );
+    for (size_t i=0; i<n; i++) {
+	p[2*i] = digits[ s[i] >> 4 ];
+	p[2*i+1] = digits[ s[i] & 15 ];
+    }
+    buf.commit( 2*n );
+    if (format == DUMP_JSONL) buf.put('"');
+
+}
+
+
+/**
+ * Write the rows of a table as text to out, in one of these formats:
+ *
+ * - DUMP_CSV: comma separated, with a header line of column names
+ * - DUMP_TSV: tab separated, with a header line
+ * - DUMP_JSONL: one JSON object per line
+ *
+ * Only the given columns are written (all columns if none are given),
+ * and where_clause may restrict the rows. Numbers are formatted with
+ * std::to_chars (shortest round-trip form for doubles) into a large
+ * buffer, which is written out in blocks; blobs are written as hex
+ * digits.  Any table can be dumped,
+ * not only those of a DatabaseRecord. If nbytes is not NULL, the
+ * number of bytes written is returned in it.
+ *
+ * \returns the number of rows written
+ */
+size_t dumpTable( FILE *out, database_t db, const std::string &table,
+		  DumpFormat format, const std::vector<std::string> &columns,
+		  std::string where_clause, size_t *nbytes ) {
+
+    DumpBuffer buf( out );
+    sqlite3_stmt *stmt;
+    vector<string> names;
+    string sql;
+    size_t nrows=0;
+    char sep = (format == DUMP_TSV) ? '\t' : ',';
+    int ret, ncols;
+
+    if (db == NULL) throw runtime_error("NO DATABASE CONNECTION!");
+
+    if (columns.empty()) sql = "SELECT * FROM "+table;
+    else {
+	vector<string> tmp( columns );
+	sql = "SELECT "+join(", ",tmp)+" FROM "+table;
+    }
+    if (where_clause != "") {
+	sql.append(" WHERE "+where_clause );
+    }
+
+    if (sqlite3_prepare_v2( db, sql.c_str(), sql.length(), &stmt, NULL )
+	!= SQLITE_OK) {
+	throw runtime_error("dumpTable(): couldn't prepare '"+sql+"': "
+			    +sqlite3_errmsg(db));
+    }
+
+    ncols = sqlite3_column_count( stmt );
+    for (int i=0; i<ncols; i++) {
+	names.push_back( sqlite3_column_name( stmt, i ) );
+    }
+
+    try {
+
+	if (format != DUMP_JSONL) {
+	    for (int i=0; i<ncols; i++) {
+		if (i) buf.put(sep);
+		putText( buf, format, names[i].data(), names[i].length() );
+	    }
+	    buf.put('\n');
+	}
+
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+
+	    if (format == DUMP_JSONL) buf.put('{');
+
+	    for (int i=0; i<ncols; i++) {
+
+		if (format == DUMP_JSONL) {
+		    if (i) buf.put(',');
+		    putText( buf, format, names[i].data(), names[i].length() );
+		    buf.put(':');
+		}
+		else if (i) buf.put(sep);
+
+		switch (sqlite3_column_type( stmt, i )) {
+		case SQLITE_INTEGER:
+		    putInt( buf, sqlite3_column_int64( stmt, i ) );
+		    break;
+		case SQLITE_FLOAT: {
+		    double val = sqlite3_column_double( stmt, i );
+		    if (format == DUMP_JSONL && !std::isfinite(val)) 
+			buf.put( "null", 4 );
+		    else 
+			putDouble( buf, val );
+		    break;
+		}
+		case SQLITE_NULL:
+		    if (format == DUMP_JSONL) buf.put( "null", 4 );
+		    break;
+		case SQLITE_BLOB: {
+		    const unsigned char *blob = (const unsigned char*)
+			sqlite3_column_blob( stmt, i );
+		    putHex( buf, format, blob, sqlite3_column_bytes( stmt, i ) );
+		    break;
+		}
+		default: 
+		    putText( buf, format, 
+			     (const char*) sqlite3_column_text( stmt, i ),
+			     sqlite3_column_bytes( stmt, i ) );
+		    break;
+		}
+
+	    }
+
+	    if (format == DUMP_JSONL) buf.put('}');
+	    buf.put('\n');
+	    nrows++;
+
+	}
+
+	if (ret != SQLITE_DONE) 
+	    throw runtime_error(string("dumpTable() step: ")+sqlite3_errmsg(db));
+
+	buf.flush();
+
+    }
+    catch (runtime_error &e) {
+	sqlite3_finalize( stmt );
+	throw;
+    }
+
+    sqlite3_finalize( stmt );
+    if (nbytes) *nbytes = buf.total();
+    return nrows;
+
+}
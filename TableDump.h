@@ -0,0 +1,21 @@
+//
+// Fast text export of database tables
+//
+
+#ifndef TABLEDUMP_H
+#define TABLEDUMP_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "DatabaseRecord.h"
+
+enum DumpFormat { DUMP_CSV, DUMP_TSV, DUMP_JSONL };
+
+size_t dumpTable( FILE *out, database_t db, const std::string &table,
+		  DumpFormat format=DUMP_CSV,
+		  const std::vector<std::string> &columns
+		  = std::vector<std::string>(),
+		  std::string where_clause="", size_t *nbytes=NULL );
+
+#endif
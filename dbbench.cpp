@@ -0,0 +1,432 @@
+//
+// dbbench: reproducible benchmarks of DatabaseRecord
+//
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <cmath>
+#include <unistd.h>
+#include "DataTables.h"
+#include "TableDump.h"
+using namespace std;
+
+/**
+ * Smallest record: one int and one double (like dbtest's TestRecord)
+ */
+struct TestRecord : public DatabaseRecord {
+
+    int i;
+    double x;
+
+    TestRecord() : DatabaseRecord() {
+	addField( "i", i );
+	addField( "x", x );
+	setTableName("bench_test");
+	addIndex( {"i"} );
+    }
+
+    static const char *key() { return "i"; }
+    static vector<string> projection() { return {"x"}; }
+    void fill( int k, mt19937 &rng, const vector<string> & ) {
+	i = k;
+	x = rng()/4294967296.0;
+    }
+
+};
+
+/**
+ * Mix of doubles and strings
+ */
+struct MixedRecord : public DatabaseRecord {
+
+    int id;
+    double a, b, c, d;
+    std::string s1, s2, s3, s4;
+
+    MixedRecord() : DatabaseRecord() {
+	addField( "id", id );
+	addField( "a", a );
+	addField( "b", b );
+	addField( "c", c );
+	addField( "d", d );
+	addField( "s1", s1 );
+	addField( "s2", s2 );
+	addField( "s3", s3 );
+	addField( "s4", s4 );
+	setTableName("bench_mixed");
+	addIndex( {"id"} );
+    }
+
+    static const char *key() { return "id"; }
+    static vector<string> projection() { return {"a","s1"}; }
+    void fill( int k, mt19937 &rng, const vector<string> &words ) {
+	id = k;
+	a = rng()/4294967296.0;
+	b = rng()/4294967296.0;
+	c = rng()/4294967296.0;
+	d = rng()/4294967296.0;
+	s1 = words[ rng() % words.size() ];
+	s2 = words[ rng() % words.size() ];
+	s3 = words[ rng() % words.size() ];
+	s4 = words[ rng() % words.size() ];
+    }
+
+};
+
+/**
+ * The full parameter record (34 fields)
+ */
+struct ParamBenchRecord : public ParamRecord {
+
+    static const char *key() { return "event_number"; }
+    static vector<string> projection() { return {"size","width","distance"}; }
+    void fill( int k, mt19937 &rng, const vector<string> & ) {
+	event_number = k;
+	telescope_id = k%4;
+	size = rng()/4294967296.0*1000;
+	width = rng()/4294967296.0*0.3;
+	length = rng()/4294967296.0*0.5;
+	distance = rng()/4294967296.0*1.5;
+	centroid.x = rng()/4294967296.0-0.5;
+	centroid.y = rng()/4294967296.0-0.5;
+	psi = rng()/4294967296.0*M_PI;
+	zenith = 0.3;
+    }
+
+};
+
+
+struct Options {
+    int maxexp;			//!< largest table has 10^maxexp rows
+    int reps;			//!< repetitions of write/read benchmarks
+    int samples;		//!< number of count() calls timed
+    int lookups;		//!< number of keyed lookups timed
+    int batchsize;
+    vector<string> records;
+    string dbfile;
+    string jsonfile;
+};
+
+/**
+ * Summary of the samples of one measurement
+ */
+struct Result {
+    string record;
+    int nfields;
+    long long nrows;
+    string metric;
+    string unit;
+    vector<double> samples;
+
+    /// nearest-rank percentile of the (sorted) samples
+    double percentile( double p ) const {
+	size_t i = (size_t) std::ceil( p/100.0*samples.size() );
+	if (i > 0) i--;
+	return samples[ min(i, samples.size()-1) ];
+    }
+    double mean() const {
+	double sum=0;
+	for (size_t i=0; i<samples.size(); i++) sum += samples[i];
+	return sum/samples.size();
+    }
+};
+
+
+static double now() {
+    return chrono::duration<double>( chrono::steady_clock::now()
+				     .time_since_epoch() ).count();
+}
+
+
+static void report( vector<Result> &results, Result r ) {
+
+    sort( r.samples.begin(), r.samples.end() );
+    cout << r.record << "\t" << r.nrows << "\t" << r.metric
+	 << "\tmedian=" << r.percentile(50)
+	 << "\tp90=" << r.percentile(90)
+	 << "\tp99=" << r.percentile(99)
+	 << "\t" << r.unit << endl;
+    results.push_back( r );
+
+}
+
+
+/**
+ * Run all benchmarks for one record type and table size:
+ *
+ * - write: rows/s for writing the whole table (including commit and
+ *   index build in finish())
+ * - read: rows/s for a full scan with readFromDatabase()
+ * - read_projected: the same, reading only Record::projection()
+ * - read_prefetch: full scan with setPrefetch() (needs a spare core)
+ * - count: latency of count() on the whole table
+ * - lookup: latency of reading one row by its (indexed) key
+ * - dump_csv, dump_jsonl: MB/s of text written by dumpTable() for the
+ *   whole table (to /dev/null)
+ */
+template <class Record>
+void benchRecord( const string &name, long long nrows, const Options &opt,
+		  database_t db, vector<Result> &results,
+		  bool static_binding=true ) {
+
+    mt19937 rng( 12345 );	// same data on every run
+    vector<string> words;
+    Record rec;
+    Result r;
+
+    for (int i=0; i<1024; i++) {
+	ostringstream word;
+	word << "word" << rng() % 100000 << "_" << i;
+	words.push_back( word.str() );
+    }
+
+    rec.setStaticBinding( static_binding );
+    rec.setDatabaseHandle( db );
+    rec.setBatchSize( opt.batchsize );
+
+    r.record = name;
+    r.nfields = rec.getNumFields();
+    r.nrows = nrows;
+
+    r.metric = "write";
+    r.unit = "rows/s";
+    for (int rep=0; rep<opt.reps; rep++) {
+	rec.clearTable();
+	double start = now();
+	for (long long k=0; k<nrows; k++) {
+	    rec.fill( k, rng, words );
+	    rec.writeToDatabase();
+	}
+	rec.finish();
+	r.samples.push_back( nrows/(now()-start) );
+    }
+    report( results, r );
+
+    r.metric = "read";
+    r.samples.clear();
+    for (int rep=0; rep<opt.reps; rep++) {
+	long long n=0;
+	double start = now();
+	rec.prepareToRead();
+	while (rec.readFromDatabase()) n++;
+	r.samples.push_back( n/(now()-start) );
+	if (n != nrows) throw runtime_error("read back wrong number of rows");
+    }
+    report( results, r );
+
+    r.metric = "read_projected";
+    r.samples.clear();
+    rec.setProjection( Record::projection() );
+    for (int rep=0; rep<opt.reps; rep++) {
+	long long n=0;
+	double start = now();
+	rec.prepareToRead();
+	while (rec.readFromDatabase()) n++;
+	r.samples.push_back( n/(now()-start) );
+    }
+    rec.setProjection( {} );
+    report( results, r );
+
+    r.metric = "read_prefetch";
+    r.samples.clear();
+    rec.setPrefetch( 256 );
+    for (int rep=0; rep<opt.reps; rep++) {
+	long long n=0;
+	double start = now();
+	rec.prepareToRead();
+	while (rec.readFromDatabase()) n++;
+	r.samples.push_back( n/(now()-start) );
+	if (n != nrows) throw runtime_error("read back wrong number of rows");
+    }
+    rec.setPrefetch( 0 );
+    report( results, r );
+
+    r.metric = "count";
+    r.unit = "us";
+    r.samples.clear();
+    for (int i=0; i<opt.samples; i++) {
+	double start = now();
+	rec.count();
+	r.samples.push_back( (now()-start)*1e6 );
+    }
+    report( results, r );
+
+    r.metric = "lookup";
+    r.samples.clear();
+    string where = string(Record::key())+"=?";
+    for (int i=0; i<opt.lookups; i++) {
+	int k = rng() % nrows;
+	double start = now();
+	rec.prepareToRead( where, {k} );
+	while (rec.readFromDatabase()) ;
+	r.samples.push_back( (now()-start)*1e6 );
+    }
+    report( results, r );
+
+    FILE *devnull = fopen( "/dev/null", "w" );
+    if (devnull == NULL) throw runtime_error("can't open /dev/null");
+    const char *formats[] = { "dump_csv", "dump_jsonl" };
+    const DumpFormat dumpformats[] = { DUMP_CSV, DUMP_JSONL };
+    r.unit = "MB/s";
+    for (int f=0; f<2; f++) {
+	r.metric = formats[f];
+	r.samples.clear();
+	for (int rep=0; rep<opt.reps; rep++) {
+	    size_t nbytes;
+	    double start = now();
+	    long long n = dumpTable( devnull, db, rec.getTableName(),
+				     dumpformats[f], vector<string>(), "",
+				     &nbytes );
+	    r.samples.push_back( nbytes/1e6/(now()-start) );
+	    if (n != nrows) throw runtime_error("dumped wrong number of rows");
+	}
+	report( results, r );
+    }
+    fclose( devnull );
+
+    rec.finish();
+    rec.clearTable();
+
+}
+
+
+static void writeJSON( ostream &out, const Options &opt,
+		       const vector<Result> &results ) {
+
+    out << setprecision(9);
+    out << "{\n";
+    out << "  \"sqlite_version\": \"" << sqlite3_libversion() << "\",\n";
+    out << "  \"config\": { \"reps\": " << opt.reps
+	<< ", \"count_samples\": " << opt.samples
+	<< ", \"lookups\": " << opt.lookups
+	<< ", \"batch_size\": " << opt.batchsize
+	<< ", \"durability\": \"bulk_load\" },\n";
+    out << "  \"results\": [\n";
+    for (size_t i=0; i<results.size(); i++) {
+	const Result &r = results[i];
+	out << "    { \"record\": \"" << r.record << "\""
+	    << ", \"fields\": " << r.nfields
+	    << ", \"rows\": " << r.nrows
+	    << ", \"metric\": \"" << r.metric << "\""
+	    << ", \"unit\": \"" << r.unit << "\""
+	    << ", \"samples\": " << r.samples.size()
+	    << ", \"min\": " << r.samples.front()
+	    << ", \"median\": " << r.percentile(50)
+	    << ", \"mean\": " << r.mean()
+	    << ", \"p90\": " << r.percentile(90)
+	    << ", \"p99\": " << r.percentile(99)
+	    << ", \"max\": " << r.samples.back() << " }"
+	    << (i+1<results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+
+}
+
+
+void usage() {
+    cerr << "usage: dbbench [-n maxexp] [-r reps] [-s count_samples] "
+	 << "[-l lookups] [-b batchsize]" << endl
+	 << "               [-t test,mixed,param,param_fieldmap] "
+	 << "[-o dbfile] [-j jsonfile]" << endl
+	 << "  runs each benchmark on tables of 10^3 .. 10^maxexp rows "
+	 << "(default 5, up to 8)" << endl;
+    exit(1);
+}
+
+
+int main(int argc, char* argv[]) {
+
+    Options opt;
+    vector<Result> results;
+    int c;
+
+    opt.maxexp = 5;
+    opt.reps = 5;
+    opt.samples = 20;
+    opt.lookups = 1000;
+    opt.batchsize = 64;
+    opt.records = { "test", "mixed", "param", "param_fieldmap" };
+    opt.dbfile = "dbbench.db";
+
+    while ((c = getopt( argc, argv, "n:r:s:l:b:t:o:j:h" )) != -1) {
+	switch (c) {
+	case 'n': opt.maxexp = atoi(optarg); break;
+	case 'r': opt.reps = atoi(optarg); break;
+	case 's': opt.samples = atoi(optarg); break;
+	case 'l': opt.lookups = atoi(optarg); break;
+	case 'b': opt.batchsize = atoi(optarg); break;
+	case 'o': opt.dbfile = optarg; break;
+	case 'j': opt.jsonfile = optarg; break;
+	case 't': {
+	    string list(optarg);
+	    size_t start=0, end;
+	    opt.records.clear();
+	    while ((end = list.find( ',', start )) != string::npos) {
+		opt.records.push_back( list.substr( start, end-start ) );
+		start = end+1;
+	    }
+	    opt.records.push_back( list.substr( start ) );
+	    break;
+	}
+	default: usage();
+	}
+    }
+    if (opt.maxexp < 3 || opt.maxexp > 8 || opt.reps < 1
+	|| opt.samples < 1 || opt.lookups < 1) usage();
+
+    try {
+
+	unlink( opt.dbfile.c_str() );
+	Database db( opt.dbfile );
+	db.setDurability( DURABILITY_BULK_LOAD );
+
+	cout << "record\trows\tmetric" << endl;
+
+	for (int e=3; e<=opt.maxexp; e++) {
+	    long long nrows = 1;
+	    for (int i=0; i<e; i++) nrows *= 10;
+
+	    for (size_t i=0; i<opt.records.size(); i++) {
+		const string &name = opt.records[i];
+		if (name == "test")
+		    benchRecord<TestRecord>( name, nrows, opt, db.getHandle(),
+					     results );
+		else if (name == "mixed")
+		    benchRecord<MixedRecord>( name, nrows, opt, db.getHandle(),
+					      results );
+		else if (name == "param")
+		    benchRecord<ParamBenchRecord>( name, nrows, opt,
+						   db.getHandle(), results );
+		else if (name == "param_fieldmap")
+		    benchRecord<ParamBenchRecord>( name, nrows, opt,
+						   db.getHandle(), results,
+						   false );
+		else usage();
+	    }
+	}
+
+	if (opt.jsonfile == "-") writeJSON( cout, opt, results );
+	else if (opt.jsonfile != "") {
+	    ofstream json( opt.jsonfile.c_str() );
+	    writeJSON( json, opt, results );
+	    if (!json) throw runtime_error("error writing "+opt.jsonfile);
+	}
+
+    }
+    catch (runtime_error &e) {
+	cerr << "dbbench: "<<e.what()<<endl;
+	return 1;
+    }
+
+    unlink( opt.dbfile.c_str() );
+    return 0;
+
+}
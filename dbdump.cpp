@@ -0,0 +1,90 @@
+//
+// dbdump: export a table of a database as CSV, TSV or JSON lines
+//
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <unistd.h>
+#include "DatabaseRecord.h"
+#include "TableDump.h"
+using namespace std;
+
+void usage() {
+    cerr << "usage: dbdump [-f csv|tsv|jsonl] [-c col1,col2,...] "
+	 << "[-w where] [-o outfile] database table" << endl;
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+
+    DumpFormat format = DUMP_CSV;
+    vector<string> columns;
+    string where, outfile;
+    int opt;
+
+    while ((opt = getopt( argc, argv, "f:c:w:o:h" )) != -1) {
+	switch (opt) {
+	case 'f':
+	    if (string(optarg) == "csv") format = DUMP_CSV;
+	    else if (string(optarg) == "tsv") format = DUMP_TSV;
+	    else if (string(optarg) == "jsonl") format = DUMP_JSONL;
+	    else usage();
+	    break;
+	case 'c': {
+	    string list(optarg);
+	    size_t start=0, end;
+	    while ((end = list.find( ',', start )) != string::npos) {
+		columns.push_back( list.substr( start, end-start ) );
+		start = end+1;
+	    }
+	    columns.push_back( list.substr( start ) );
+	    break;
+	}
+	case 'w':
+	    where = optarg;
+	    break;
+	case 'o':
+	    outfile = optarg;
+	    break;
+	default:
+	    usage();
+	}
+    }
+
+    if (argc-optind != 2) usage();
+
+    FILE *out = stdout;
+    if (outfile != "" && (out = fopen( outfile.c_str(), "w" )) == NULL) {
+	cerr << "dbdump: can't write '"<<outfile<<"'"<<endl;
+	return 1;
+    }
+
+    try {
+
+	Database db( argv[optind] );
+	size_t nbytes;
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	size_t nrows = dumpTable( out, db.getHandle(), argv[optind+1], format,
+				  columns, where, &nbytes );
+	double elapsed = chrono::duration<double>( chrono::steady_clock::now()
+						   - start ).count();
+
+	if (out != stdout && fclose( out ) != 0) 
+	    throw runtime_error("error closing '"+outfile+"'");
+
+	cerr << "dbdump: "<<nrows<<" rows, "<<nbytes/1e6<<" MB in "
+	     << elapsed<<" s ("<<nbytes/1e6/elapsed<<" MB/s)"<<endl;
+
+    }
+    catch (runtime_error &e) {
+	cerr << "dbdump: "<<e.what()<<endl;
+	return 1;
+    }
+
+    return 0;
+
+}
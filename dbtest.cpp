@@ -1,6 +1,7 @@
 #include <iostream>
 #include <sqlite3.h>
 #include "DatabaseRecord.h"
+#include "ColumnSnapshot.h"
 using namespace std;
 
 struct TestRecord : public DatabaseRecord {
@@ -30,6 +31,19 @@ struct AnotherRecord : public DatabaseRecord {
 };
 
 
+struct AnotherRecordView : public DatabaseRecord {
+
+    int number;
+    std::string_view name; // no copy: points at the row read by sqlite
+
+    AnotherRecordView() : DatabaseRecord() {
+ 	addField( "name", name );
+	addField( "number", number );
+	setTableName("names");
+    }
+
+};
+
 
 int main(int argc, char* argv[]) {
 
@@ -55,6 +69,8 @@ int main(int argc, char* argv[]) {
 
 	rec.clearTable(); // clear data that was there previously in
 			  // table (it's appended otherwise)
+
+	rec.setBatchSize( 100 ); // write 100 rows per INSERT statement
 	
 	cout << "Writing a bunch of random events..."<<endl;
 	for (int i=0; i<10000; i++){
@@ -83,12 +99,16 @@ int main(int argc, char* argv[]) {
 	// matching the criteria:
 
 	cout << "TEST count: "<<rec.count()<<endl;
-	char test[20];
 	for (int i=0; i<10; i++) {
-	    sprintf(test,"x<%f", i*0.1);
-	    cout << "COUNT: x<"<<i*0.1<<" : "<<rec.count(test)<<endl;
+	    cout << "COUNT: x<"<<i*0.1<<" : "<<rec.count("x<?", {i*0.1})<<endl;
 	}
 
+	// the aggregates work on a plain sqlite3_open() handle too
+	FieldStatistics st = rec.stats( "x" );
+	cout << "TEST stats: count="<<st.count<<" mean(x)="<<st.mean<<endl;
+	if (st.count != rec.count())
+	    throw runtime_error("stats() counted the wrong number of rows");
+
 	
 	// now print out some stuff for the other test stucture: note
 	// values will be appended here, since I never call
@@ -107,9 +127,98 @@ int main(int argc, char* argv[]) {
 	    cout << a << endl;
 	}
 
+	// read the names again without copying the strings, but keep
+	// them in the record's string arena so they are valid after the
+	// loop:
+
+	AnotherRecordView av;
+	vector<std::string_view> names;
+	av.setDatabaseHandle( db );
+	av.useStringArena( true );
+	av.prepareToRead();
+	while (av.readFromDatabase()) {
+	    names.push_back( av.name );
+	}
+	av.finish();
+	cout << "READ BACK "<<names.size()<<" NAMES, LAST: '"
+	     << (names.empty() ? "" : names.back()) << "'" << endl;
+
+	// export the tables to columnar snapshot files and read them
+	// back through a memory mapping:
+
+	ColumnSnapshot::write( rec, "testtable.cols" );
+	ColumnSnapshot::write( a, "names.cols" );
+
+	// assignment copies the values, but rec stays connected
+
+	TestRecord copy( rec );
+	copy.i = -42;
+	rec = copy;
+	rec.writeToDatabase();
+	if (rec.count( "i=?", {-42} ) != 1)
+	    throw runtime_error("assigned record was not written");
+
 	a.finish();
 	rec.finish();
 
+	cout << rec.getStats() << endl;
+	cout << a.getStats() << endl;
+
+	ColumnSnapshot testcols( "testtable.cols" );
+	ColumnSpan<double> x = testcols.get<double>("x");
+	double sum = 0;
+	for (size_t i=0; i<x.size(); i++) sum += x[i];
+	cout << "SNAPSHOT: "<<testcols.size()<<" rows, mean x="
+	     << (x.size() ? sum/x.size() : 0) << endl;
+
+	ColumnSnapshot namecols( "names.cols" );
+	StringColumn snapnames = namecols.getStrings("name");
+	cout << "SNAPSHOT: "<<snapnames.size()<<" names, LAST: '"
+	     << (snapnames.size() ? snapnames[snapnames.size()-1] : "") 
+	     << "'" << endl;
+
+	// a row the database refuses, written asynchronously: the
+	// error must come back from finish()
+
+	sqlite3_exec( db, "CREATE TEMP TRIGGER refuse_row "
+		      "BEFORE INSERT ON testtable WHEN NEW.i < 0 "
+		      "BEGIN SELECT RAISE(ABORT,'row refused'); END", 
+		      NULL, NULL, NULL );
+	TestRecord bad;
+	bad.setDatabaseHandle( db );
+	bad.setAsyncWrite( 16 );
+	bad.i = -1;
+	bad.writeToDatabase();
+	bool thrown = false;
+	try {
+	    bad.finish();
+	}
+	catch (runtime_error &e) {
+	    cout << "ASYNC WRITE ERROR: "<<e.what()<<endl;
+	    thrown = true;
+	}
+	if (thrown == false) 
+	    throw runtime_error("failed asynchronous write was not reported");
+
+	// ... and so must one dropped from the last, partial batch
+
+	TestRecord badbatch;
+	badbatch.setDatabaseHandle( db );
+	badbatch.setBatchSize( 16 );
+	badbatch.i = -1;
+	badbatch.writeToDatabase();
+	thrown = false;
+	try {
+	    badbatch.finish();
+	}
+	catch (runtime_error &e) {
+	    cout << "BATCH WRITE ERROR: "<<e.what()<<endl;
+	    thrown = true;
+	}
+	sqlite3_exec( db, "DROP TRIGGER refuse_row", NULL, NULL, NULL );
+	if (thrown == false) 
+	    throw runtime_error("row dropped from a batch was not reported");
+
 
     }
     catch (runtime_error &e) {
@@ -1,22 +1,34 @@
 #include <iostream>
 #include <sqlite3.h>
 #include <cmath>
-#include <ctime>
+#include <thread>
+#include <algorithm>
 #include "DataTables.h"
+#include "ParallelRead.h"
+#include "EZCuts.h"
+#include "ColumnSnapshot.h"
+#include "TableDump.h"
+#include "ShardedDatabase.h"
 using namespace std;
 
 void addEZCutsFunctions( sqlite3 *db );
 void ezwidth_func(sqlite3_context* context,int n,sqlite3_value** val);
 
-double getTime();
-
 
 int main(int argc, char* argv[]) {
 
 
     try {
 
-	Database db("test.db");
+	DatabaseOptions options;
+	options.cache_kb = 64*1024;
+	options.mmap_size = 256*1024*1024;
+	options.temp_store = 2;
+
+	Database db("test.db", options);
+	db.setDurability( DURABILITY_BULK_LOAD );
+
+	cout << "DATABASE OPTIONS IN EFFECT:" << endl << db.getOptions() << endl;
     	
 	HeaderRecord h;
 	ParamRecord p;
@@ -38,6 +50,13 @@ int main(int argc, char* argv[]) {
 	m.clearTable();
 	e.clearTable();
 
+	// write the parameters and derived parameters from a separate
+	// thread, in batches:
+	p.setAsyncWrite( 4096 );
+	p.setBatchSize( 64 );
+	p.setCommitPolicy( 0, 0, 500 ); // commit at least every 0.5 s
+	e.setAsyncWrite( 4096 );
+
 	h.sourcename="sgra*";
 	h.nadc=490;
 	h.writeToDatabase();
@@ -47,6 +66,7 @@ int main(int argc, char* argv[]) {
 		p.event_number = i;
 		p.telescope_id = j;
 		p.size = i*4.0+j;
+		p.invalid = (i%10 == 0);
 		p.writeToDatabase();
 	    }
 	}
@@ -58,6 +78,11 @@ int main(int argc, char* argv[]) {
 		s.telescope_id = m.telescope_id = j;
 		s.primary_energy = i*0.1;
 		m.muonness = i*101;
+		m.nplotpoints = i%50;
+		for (int k=0; k<m.nplotpoints; k++) {
+		    m.plot[k].x = k;
+		    m.plot[k].y = i;
+		}
 
 		s.writeToDatabase();
 		m.writeToDatabase();
@@ -65,41 +90,70 @@ int main(int argc, char* argv[]) {
 	}
 
 
-	p.prepareToRead();
-
-	while (p.readFromDatabase()) {
-	    e.event_number = p.event_number;
-	    e.telescope_id = p.telescope_id;
-	    e.ezwidth = p.width*2+1;
-	    e.ezlength = p.length*2+1;
-	    e.ezsize = p.size*2+1;
-	    e.writeToDatabase();
-	}
-
-
-	double start,end;
 	int count;
 
+	cout << "TEST: computeEZParams: "<< endl;
+	count = computeEZParams( p, e );
+	cout << "\tcount="<<count << endl;
+
+	// (timings of these are in dbbench)
 
-	for (int k=0; k<10; k++) {
-	    cout << "TEST: count(): "<< endl;
-	    start = getTime();
-	    count = p.count();
-	    end= getTime();
-	    cout << "\telapsed="<<end-start<<endl;
-	    cout << "\tcount="<<count << endl;
+	cout << "TEST: count(): "<< endl;
+	cout << "\tcount="<<p.count()
+	     << " invalid="<<p.count( "invalid=?", {1} ) << endl;
 	    
-	    cout << "TEST: iterate: "<< endl;
-	    count =0;
-	    p.prepareToRead();
-	    start = getTime();
-	    while (p.readFromDatabase()) {
-		count++;
-	    }
-	    end= getTime();
-	    cout << "\telapsed="<<end-start<<endl;
-	    cout << "\tcount="<<count << endl;
+	cout << "TEST: iterate: "<< endl;
+	count =0;
+	p.prepareToRead();
+	while (p.readFromDatabase()) {
+	    count++;
 	}
+	cout << "\tcount="<<count << endl;
+
+	cout << "TEST: projected iterate: "<< endl;
+	count =0;
+	p.setProjection( {"size","width","distance"} );
+	p.prepareToRead();
+	while (p.readFromDatabase()) {
+	    count++;
+	}
+	p.setProjection( {} );
+	cout << "\tcount="<<count << endl;
+
+	cout << "TEST: stats and histogram: "<< endl;
+	FieldStatistics st = p.stats( "size" );
+	vector<long long> hist = p.histogram( "size", 4, 0, 4000, 
+					      "telescope_id=?", {2} );
+	cout << "\tcount="<<st.count<<" mean(size)="<<st.mean
+	     << " hist(size)="<<hist[0]<<","<<hist[1]<<","<<hist[2]
+	     << ","<<hist[3]<< endl;
+
+	cout << "TEST: readAll: "<< endl;
+	vector<ParamRecord> rows = p.readAll<ParamRecord>( "telescope_id=?", {0} );
+	sort( rows.begin(), rows.end(), 
+	      []( const ParamRecord &a, const ParamRecord &b ) {
+		  return a.size > b.size; 
+	      } );
+	cout << "\tcount="<<rows.size()<<" max(size)="<<rows[0].size << endl;
+
+	cout << "TEST: readColumns: "<< endl;
+	DatabaseColumns cols = p.readColumns( {"size","width","length"} );
+	cout << "\tcount="<<cols.size() << endl;
+
+	cout << "TEST: lazy muon plots: "<< endl;
+	count = 0;
+	int npoints = 0;
+	m.prepareToRead( "telescope_id=?", {0} );
+	while (m.readFromDatabase()) {
+	    if (m.muonness < 5000) continue;	// plot not needed
+	    m.readBlob( "plot" );
+	    if (m.nplotpoints > 0 
+		&& m.plot[m.nplotpoints-1].y != m.event_number)
+		throw runtime_error("muon plot doesn't match its row");
+	    npoints += m.nplotpoints;
+	    count++;
+	}
+	cout << "\tcount="<<count<<" points="<<npoints << endl;
 
 	cout << "FINISHING"<<endl;
 
@@ -110,6 +164,94 @@ int main(int argc, char* argv[]) {
 	h.finish();
 	e.finish();
 
+
+	// scan the (now committed) paramdata table with one thread per
+	// core, counting rows per thread:
+
+	int nthreads = std::thread::hardware_concurrency();
+	if (nthreads < 1) nthreads = 1;
+	vector<int> counts( nthreads, 0 );
+
+	cout << "TEST: parallel iterate ("<<nthreads<<" threads): "<< endl;
+	parallelRead<ParamRecord>( "test.db", nthreads,
+				   [&counts]( ParamRecord &, int t ) {
+				       counts[t]++;
+				   }, "", options );
+	count = 0;
+	for (int t=0; t<nthreads; t++) count += counts[t];
+	cout << "\tcount="<<count << endl;
+
+
+	// export the finished paramdata table to a columnar snapshot,
+	// and scan it through the memory mapping:
+
+	cout << "TEST: column snapshot: "<< endl;
+	ColumnSnapshot::write( p, "paramdata.cols" );
+	ColumnSnapshot snap( "paramdata.cols" );
+	ColumnSpan<double> size = snap.get<double>("size");
+	double sum = 0;
+	for (size_t i=0; i<size.size(); i++) sum += size[i];
+	cout << "\tcount="<<snap.size()<<" sum(size)="<<sum << endl;
+
+
+	// export the match results as CSV:
+
+	cout << "TEST: dumpTable: "<< endl;
+	FILE *csv = fopen( "ezparams.csv", "w" );
+	if (csv == NULL) throw runtime_error("can't write ezparams.csv");
+	count = dumpTable( csv, db.getHandle(), "ezparams", DUMP_CSV,
+			   {"event_number","telescope_id","ezwidth"} );
+	fclose( csv );
+	cout << "\tcount="<<count << endl;
+
+
+	// match simulated showers with their parameters in one pass:
+
+	cout << "TEST: joined read: "<< endl;
+	DatabaseJoin events( {&s, &p} );
+	events.prepareToRead( "simdata.primary_energy > ?", {5.0} );
+	count = 0;
+	while (events.readFromDatabase()) {
+	    if (s.event_number != p.event_number 
+		|| s.telescope_id != p.telescope_id)
+		throw runtime_error("joined rows don't match");
+	    count++;
+	}
+	events.finish();
+	cout << "\tcount="<<count << endl;
+
+
+	// write each telescope's parameters to a shard of its own, from
+	// one thread per telescope, and merge them into one file:
+
+	cout << "TEST: sharded write: "<< endl;
+	ShardedDatabase run( "sharded.db", 4 );
+	run.setDurability( DURABILITY_BULK_LOAD );
+	vector<std::thread> writers;
+	for (int j=0; j<4; j++) {
+	    writers.push_back( std::thread( [&run,j]() {
+		ParamRecord tp;
+		tp.setDatabaseHandle( run.shard(j).getHandle() );
+		for (int i=0; i<1000; i++) {
+		    tp.event_number = i;
+		    tp.telescope_id = j;
+		    tp.size = i*4.0+j;
+		    tp.writeToDatabase();
+		}
+		tp.finish();
+	    } ) );
+	}
+	for (int j=0; j<4; j++) writers[j].join();
+	count = run.merge();
+	run.removeShards();
+	cout << "\tcount="<<count << endl;
+
+
+	// where the time went, per table:
+
+	cout << "STATS:" << endl;
+	writeStatsJSON( cout, db.getStats() );
+
     }
     catch (runtime_error &e) {
 	cerr << "RUNTIME ERROR: "<<e.what()<<endl;
@@ -138,63 +280,13 @@ void addEZCutsFunctions( sqlite3 *db ) {
 
 void ezwidth_func(sqlite3_context* context,int n,sqlite3_value** val) {
 
-    const double WA = 0.003;
-    const double WB = 0.04679;
-    const double WC = 9.866;
-    const double WD = 0.1832;
-    const double WE = 0.01534;
-    const double WF = 0.00248;
-    const double WGAMMA = 0.949;
-    const double WCOSPOW = 1.5;
-
     double wid = sqlite3_value_double( val[0] );
     double siz = sqlite3_value_double( val[1] );
     double zen = sqlite3_value_double( val[2] );
+    double ezwidth;
 
-    //============================================================
-    // Calculate ezwidth , ezlength
-    //============================================================
-    
-    const double cos60 = cos(60.0*M_PI/180.0);
-    double ezwidth2, ezlength2;
-    double ezwidth, ezlength, wzenithfactor;
-    double x,wshift2,lshift2,lterm1,wterm1;
-    
-    wzenithfactor = ( (pow(cos60, WGAMMA)/pow(cos60,WCOSPOW)) 
-                            /pow( cos(zen), WGAMMA ));
-
-    x=log(siz/0.4489); // need to divide out .4489 since fit
-                              // values assume 490 camera with no
-                              // corrections
-
-
-    wshift2 = wid*wid - WA;
-    wterm1 = (wshift2*wzenithfactor>1e-20)? 
-        sqrt(wshift2*wzenithfactor): 1e-20;
-
-    ezwidth2 = WA + pow( wterm1 - WB*(x-WC) - WE*pow(x-WC,2) 
-                            - WF*pow(x-WC,3) ,2 );
-    ezwidth = (ezwidth2>0.0)? sqrt(ezwidth2) : 0.0;
-
-    cout << "DEBUG: ezwidth="<<ezwidth<<endl;
+    scaledParameter( &wid, &siz, &zen, &ezwidth, 1, EZWIDTH_COEFFICIENTS );
 
     sqlite3_result_double( context, ezwidth );
 
 };
-
-
-
-
-double getTime() {
-    struct timeval tv;
-    struct timezone tz;
-    double time;
-
-    gettimeofday( &tv,&tz);
-    
-    time = tv.tv_sec + (double)tv.tv_usec/1.0e6;
-    
-    return time;
-
-
-}